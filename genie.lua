@@ -65,6 +65,37 @@ project "Test"
 	links { 
 		"Keson",
 	}
+
+	configuration "linux"
+		links {
+			"pthread",
+		}
+
+	configuration {}
+	includedirs { 
+		"src/",
+	}
+
+
+-- The tests again with the encode cache, which is off by default. The library is
+-- built into it rather than linked, since the cache changes the layout of Node.
+project "TestEncodeCache"
+	kind "ConsoleApp"
+	targetdir "out"
+	files { 
+		"src/**",
+		"test/**",
+	}
+	defines {
+		"KESON_ENABLE_ENCODE_CACHE=1",
+	}
+
+	configuration "linux"
+		links {
+			"pthread",
+		}
+
+	configuration {}
 	includedirs { 
 		"src/",
 	}
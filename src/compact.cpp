@@ -0,0 +1,289 @@
+#include "compact.h"
+#include "util.h"
+
+#include <cassert>
+#include <cstring>
+
+namespace keson
+{
+    static_assert(sizeof(void*) != 8 || sizeof(CompactNode) == 16, "CompactNode should pack into 16 bytes");
+
+    // Everything up to the tag byte is available for inline characters.
+    static const size_t INLINE_CAPACITY = sizeof(CompactNode) - 1;
+
+    const CompactNode CompactNode::NULL_NODE;
+
+    CompactNode::CompactNode()
+        : _ptr(nullptr)
+        , _size(0)
+        , _spare{}
+        , _tag(Kind_NULL)
+    { }
+
+    CompactNode::CompactNode(const Node& node) : CompactNode() {
+        if (node.isAtom()) {
+            assignAtom(node.atom());
+        }
+        else if (node.isVector()) {
+            auto& v = node.vector();
+            assert(v.size() <= UINT32_MAX);
+            CompactNode* c = v.empty() ? nullptr : new CompactNode[v.size()];
+            for (size_t i = 0; i < v.size(); i++) {
+                c[i] = CompactNode(v[i]);
+            }
+            _ptr = c;
+            _size = (uint32_t)v.size();
+            _tag = Kind_VECTOR;
+        }
+        else if (node.isPacked()) {
+            Node unpacked = node;
+            unpacked.vector();
+            *this = CompactNode(unpacked);
+        }
+        else if (node.isMap()) {
+            auto& m = node.map();
+            assert(m.size() <= UINT32_MAX);
+            CompactNode* c = m.empty() ? nullptr : new CompactNode[m.size() * 2];
+            size_t i = 0;
+            for (auto& keyChild : m) {
+                c[i++].assignAtom(keyChild.first);
+                c[i++] = CompactNode(keyChild.second);
+            }
+            _ptr = c;
+            _size = (uint32_t)m.size();
+            _tag = Kind_MAP;
+        }
+    }
+
+    CompactNode::CompactNode(const CompactNode& other) : CompactNode() {
+        copyFrom(other);
+    }
+
+    CompactNode::CompactNode(CompactNode&& other) noexcept {
+        std::memcpy((void*)this, (const void*)&other, sizeof(CompactNode));
+        other.clear();
+    }
+
+    CompactNode::~CompactNode() {
+        release();
+    }
+
+    CompactNode& CompactNode::operator=(const CompactNode& other) {
+        if (this != &other) {
+            release();
+            copyFrom(other);
+        }
+        return *this;
+    }
+
+    CompactNode& CompactNode::operator=(CompactNode&& other) noexcept {
+        if (this != &other) {
+            release();
+            std::memcpy((void*)this, (const void*)&other, sizeof(CompactNode));
+            other.clear();
+        }
+        return *this;
+    }
+
+    Node CompactNode::toNode() const {
+        switch (kind()) {
+        case Kind_INLINE_ATOM:
+        case Kind_ATOM:
+            return Node(std::string(atom()));
+        case Kind_VECTOR: {
+            Node::Vector v;
+            v.reserve(_size);
+            for (auto& child : *this) {
+                v.push_back(child.toNode());
+            }
+            return Node(std::move(v));
+        }
+        case Kind_MAP: {
+            Node result = Node::Map();
+            for (size_t i = 0; i < _size; i++) {
+                result[std::string(key(i))] = value(i).toNode();
+            }
+            return result;
+        }
+        default:
+            return Node();
+        }
+    }
+
+    bool CompactNode::isNull() const                          { return kind() == Kind_NULL; }
+    bool CompactNode::isAtom() const                          { return kind() == Kind_INLINE_ATOM || kind() == Kind_ATOM; }
+    bool CompactNode::isVector() const                        { return kind() == Kind_VECTOR; }
+    bool CompactNode::isMap() const                           { return kind() == Kind_MAP; }
+
+    std::string_view CompactNode::atom() const {
+        if (kind() == Kind_INLINE_ATOM) {
+            return std::string_view(reinterpret_cast<const char*>(this), _tag >> INLINE_LENGTH_SHIFT);
+        }
+        assert(kind() == Kind_ATOM);
+        return std::string_view(static_cast<const char*>(_ptr), _size);
+    }
+
+    std::string CompactNode::value_or(std::string fallback) const { return !isAtom() ? fallback : std::string(atom()); }
+    int8_t      CompactNode::value_or(int8_t fallback) const      { return !isAtom() ? fallback : (int8_t)(*this); }
+    uint8_t     CompactNode::value_or(uint8_t fallback) const     { return !isAtom() ? fallback : (uint8_t)(*this); }
+    int16_t     CompactNode::value_or(int16_t fallback) const     { return !isAtom() ? fallback : (int16_t)(*this); }
+    uint16_t    CompactNode::value_or(uint16_t fallback) const    { return !isAtom() ? fallback : (uint16_t)(*this); }
+    int32_t     CompactNode::value_or(int32_t fallback) const     { return !isAtom() ? fallback : (int32_t)(*this); }
+    uint32_t    CompactNode::value_or(uint32_t fallback) const    { return !isAtom() ? fallback : (uint32_t)(*this); }
+    int64_t     CompactNode::value_or(int64_t fallback) const     { return !isAtom() ? fallback : (int64_t)(*this); }
+    uint64_t    CompactNode::value_or(uint64_t fallback) const    { return !isAtom() ? fallback : (uint64_t)(*this); }
+    float       CompactNode::value_or(float fallback) const       { return !isAtom() ? fallback : (float)(*this); }
+    double      CompactNode::value_or(double fallback) const      { return !isAtom() ? fallback : (double)(*this); }
+    bool        CompactNode::value_or(bool fallback) const        { return !isAtom() ? fallback : (bool)(*this); }
+
+    CompactNode::operator std::string() const                 { return std::string(atom()); }
+    CompactNode::operator int8_t() const                      { return from_string<int8_t>(atom());   }
+    CompactNode::operator uint8_t() const                     { return from_string<uint8_t>(atom());  }
+    CompactNode::operator int16_t() const                     { return from_string<int16_t>(atom());  }
+    CompactNode::operator uint16_t() const                    { return from_string<uint16_t>(atom()); }
+    CompactNode::operator int32_t() const                     { return from_string<int32_t>(atom());  }
+    CompactNode::operator uint32_t() const                    { return from_string<uint32_t>(atom()); }
+    CompactNode::operator int64_t() const                     { return from_string<int64_t>(atom());  }
+    CompactNode::operator uint64_t() const                    { return from_string<uint64_t>(atom()); }
+    CompactNode::operator float() const                       { return from_string<float>(atom());    }
+    CompactNode::operator double() const                      { return from_string<double>(atom());   }
+    CompactNode::operator bool() const                        { return from_string<bool>(atom());     }
+
+    size_t CompactNode::length() const {
+        switch (kind()) {
+        case Kind_VECTOR:
+            return _size;
+        case Kind_NULL:
+            return 0;
+        default:
+            return 1;
+        }
+    }
+
+    const CompactNode* CompactNode::begin() const {
+        switch (kind()) {
+        case Kind_VECTOR:
+            return children();
+        case Kind_NULL:
+            return nullptr;
+        default:
+            return this;
+        }
+    }
+
+    const CompactNode* CompactNode::end() const {
+        switch (kind()) {
+        case Kind_VECTOR:
+            return children() + _size;
+        case Kind_NULL:
+            return nullptr;
+        default:
+            return this + 1;
+        }
+    }
+
+    const CompactNode& CompactNode::operator[](size_t pos) const {
+        assert(isVector() && pos < _size);
+        return children()[pos];
+    }
+
+    size_t CompactNode::mapSize() const {
+        return isMap() ? _size : 0;
+    }
+
+    std::string_view CompactNode::key(size_t index) const {
+        assert(isMap() && index < _size);
+        return children()[index * 2].atom();
+    }
+
+    const CompactNode& CompactNode::value(size_t index) const {
+        assert(isMap() && index < _size);
+        return children()[index * 2 + 1];
+    }
+
+    const CompactNode& CompactNode::operator[](std::string_view key) const {
+        if (isMap()) {
+            const CompactNode* c = children();
+            for (size_t i = 0; i < _size; i++) {
+                if (c[i * 2].atom() == key) {
+                    return c[i * 2 + 1];
+                }
+            }
+        }
+        return NULL_NODE;
+    }
+
+    const CompactNode& CompactNode::operator[](const char* key) const {
+        return (*this)[std::string_view(key)];
+    }
+
+    CompactNode::Kind CompactNode::kind() const {
+        return (Kind)(_tag & KIND_MASK);
+    }
+
+    void CompactNode::assignAtom(std::string_view value) {
+        assert(isNull());
+        if (value.size() <= INLINE_CAPACITY) {
+            std::memcpy(reinterpret_cast<char*>(this), value.data(), value.size());
+            _tag = (uint8_t)(Kind_INLINE_ATOM | (value.size() << INLINE_LENGTH_SHIFT));
+        }
+        else {
+            assert(value.size() <= UINT32_MAX);
+            char* chars = new char[value.size()];
+            std::memcpy(chars, value.data(), value.size());
+            _ptr = chars;
+            _size = (uint32_t)value.size();
+            _tag = Kind_ATOM;
+        }
+    }
+
+    void CompactNode::copyFrom(const CompactNode& other) {
+        assert(isNull());
+        switch (other.kind()) {
+        case Kind_ATOM:
+            assignAtom(other.atom());
+            break;
+        case Kind_VECTOR:
+        case Kind_MAP: {
+            size_t count = other.kind() == Kind_MAP ? other._size * 2 : other._size;
+            CompactNode* c = count == 0 ? nullptr : new CompactNode[count];
+            for (size_t i = 0; i < count; i++) {
+                c[i] = other.children()[i];
+            }
+            _ptr = c;
+            _size = other._size;
+            _tag = other._tag;
+            break;
+        }
+        default:
+            std::memcpy((void*)this, (const void*)&other, sizeof(CompactNode));
+            break;
+        }
+    }
+
+    void CompactNode::release() {
+        switch (kind()) {
+        case Kind_ATOM:
+            delete[] static_cast<char*>(_ptr);
+            break;
+        case Kind_VECTOR:
+        case Kind_MAP:
+            delete[] static_cast<CompactNode*>(_ptr);
+            break;
+        default:
+            break;
+        }
+        clear();
+    }
+
+    void CompactNode::clear() {
+        _ptr = nullptr;
+        _size = 0;
+        std::memset(_spare, 0, sizeof(_spare));
+        _tag = Kind_NULL;
+    }
+
+    const CompactNode* CompactNode::children() const {
+        return static_cast<const CompactNode*>(_ptr);
+    }
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <cstdint>
+
+#include "conf.h"
+#include "node.h"
+
+namespace keson
+{
+    // Read-only snapshot of a Node tree packed into 16 bytes per node on 64-bit targets.
+    //
+    // Atoms that fit in the node itself (most numbers, booleans and short names) are
+    // stored inline. Longer atoms, vectors and maps own a single heap block pointed to by
+    // the node; the children of a vector or map are laid out contiguously in that block,
+    // maps as alternating key and value nodes in insertion order.
+    //
+    // The accessors mirror the read side of Node, returning string_views where Node
+    // returns string references.
+    class CompactNode {
+    public:
+        CompactNode();
+        CompactNode(const Node& node);
+        CompactNode(const CompactNode& other);
+        CompactNode(CompactNode&& other) noexcept;
+        ~CompactNode();
+
+        CompactNode& operator=(const CompactNode& other);
+        CompactNode& operator=(CompactNode&& other) noexcept;
+
+        Node toNode() const;
+
+        bool isNull() const;
+        bool isAtom() const;
+        bool isVector() const;
+        bool isMap() const;
+
+        //////////
+        // Atom //
+        //////////
+
+        std::string_view atom() const;
+
+        std::string value_or(std::string   fallback) const;
+        int8_t      value_or(int8_t        fallback) const;
+        uint8_t     value_or(uint8_t       fallback) const;
+        int16_t     value_or(int16_t       fallback) const;
+        uint16_t    value_or(uint16_t      fallback) const;
+        int32_t     value_or(int32_t       fallback) const;
+        uint32_t    value_or(uint32_t      fallback) const;
+        int64_t     value_or(int64_t       fallback) const;
+        uint64_t    value_or(uint64_t      fallback) const;
+        float       value_or(float         fallback) const;
+        double      value_or(double        fallback) const;
+        bool        value_or(bool          fallback) const;
+
+        operator std::string() const;
+        operator int8_t() const;
+        operator uint8_t() const;
+        operator int16_t() const;
+        operator uint16_t() const;
+        operator int32_t() const;
+        operator uint32_t() const;
+        operator int64_t() const;
+        operator uint64_t() const;
+        operator float() const;
+        operator double() const;
+        operator bool() const;
+
+        ////////////
+        // Vector //
+        ////////////
+
+        size_t length() const;
+
+        const CompactNode* begin() const;
+        const CompactNode* end() const;
+
+        const CompactNode& operator[](size_t pos) const;
+
+        /////////
+        // Map //
+        /////////
+
+        size_t mapSize() const;
+
+        std::string_view key(size_t index) const;
+        const CompactNode& value(size_t index) const;
+
+        const CompactNode& operator[](std::string_view key) const;
+        const CompactNode& operator[](const char* key) const;
+
+    private:
+        enum Kind : uint8_t {
+            Kind_NULL,
+            Kind_INLINE_ATOM,
+            Kind_ATOM,
+            Kind_VECTOR,
+            Kind_MAP,
+        };
+
+        static const uint8_t KIND_MASK = 0x0f;
+        static const uint8_t INLINE_LENGTH_SHIFT = 4;
+
+        Kind kind() const;
+
+        void assignAtom(std::string_view value);
+        void copyFrom(const CompactNode& other);
+        void release();
+        void clear();
+
+        const CompactNode* children() const;
+
+        static const CompactNode NULL_NODE;
+
+        // Inline atoms reuse the bytes of _ptr, _size and _spare for their characters, so
+        // only _tag must stay clear of them.
+        void*    _ptr;
+        uint32_t _size;
+        uint8_t  _spare[3];
+        uint8_t  _tag;
+    };
+}
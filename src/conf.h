@@ -1,5 +1,36 @@
-#pragma once
-
-#ifndef KESON_ENABLE_WSTRING
-#define KESON_ENABLE_WSTRING 0
-#endif
+#pragma once
+
+#ifndef KESON_ENABLE_WSTRING
+#define KESON_ENABLE_WSTRING 0
+#endif
+
+// Caches the structural hash of every vector and map next to it, so that repeated
+// hashing and inequality checks skip unchanged subtrees. Only containers sealed by
+// Node::snapshot() and not accessed mutably since use the cache.
+#ifndef KESON_ENABLE_HASH_CACHE
+#define KESON_ENABLE_HASH_CACHE 1
+#endif
+
+// Keeps the encoded output of every vector and map next to it, so that encoding a
+// document again only re-encodes the containers accessed mutably since. Like the hash
+// cache, only containers sealed by Node::snapshot() use it. Each level of nesting
+// holds its own copy of the output below it.
+#ifndef KESON_ENABLE_ENCODE_CACHE
+#define KESON_ENABLE_ENCODE_CACHE 0
+#endif
+
+// Keeps a global count of the memory owned by decoded trees, see memoryCounter(). Each
+// decode then walks its result once more to measure it.
+#ifndef KESON_ENABLE_MEMORY_COUNTER
+#define KESON_ENABLE_MEMORY_COUNTER 0
+#endif
+
+// Scans strings 16 bytes at a time with SSE2 when encoding. On by default where the
+// compiler targets SSE2.
+#ifndef KESON_ENABLE_SSE2
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define KESON_ENABLE_SSE2 1
+#else
+#define KESON_ENABLE_SSE2 0
+#endif
+#endif
@@ -1,411 +1,755 @@
-#include "decode.h"
-#include "node.h"
-
-#include <sstream>
-#include <charconv>
-#include <cassert>
-
-namespace keson
-{
-    class Parser
-    {
-    public:
-        Parser(std::istream& stream)
-            : _stream(stream)
-        { }
-
-        Node parseNode()
-        {
-            skipAir();
-            switch (peek())
-            {
-            case '{':
-                return parseMap();
-            case '[':
-                return parseVector();
-            default:
-                return parseAtom();
-            }
-        }
-
-    private:
-        uint32_t parseHex(const char* chars, int len)
-        {
-            uint32_t v;
-            auto result = std::from_chars(chars, chars + len, v, 16);
-            if (result.ec != (std::errc)0 || result.ptr != chars + len)
-            {
-                throw ParseError("Internal error when parsing hex");
-            }
-            return v;
-        }
-
-        std::string encodeUtf8(uint32_t v)
-        {
-            if (v < 0x7f)
-            {
-                return std::string(1, (char)v);
-            }
-            
-            if (v < 0x7ff)
-            {
-                char b[] = {
-                    0b1100'0000 | (char)(v >> 6),
-                    0b1000'0000 | (char)(v & 0b0011'1111)
-                };
-                return std::string(b, b + sizeof(b) / sizeof(char));
-            }
-            
-            if (v < 0xffff)
-            {
-                char b[] = {
-                    0b1110'0000 | (char)(v >> 12),
-                    0b1000'0000 | (char)((v >> 6) & 0b0011'1111),
-                    0b1000'0000 | (char)(v & 0b0011'1111)
-                };
-                return std::string(b, b + sizeof(b) / sizeof(char));
-            }
-            
-            if (v < 0x10ffff)
-            {
-                char b[] = {
-                    0b1111'0000 | (char)(v >> 18),
-                    0b1000'0000 | (char)((v >> 12) & 0b0011'1111),
-                    0b1000'0000 | (char)((v >> 6) & 0b0011'1111),
-                    0b1000'0000 | (char)(v & 0b0011'1111)
-                };
-                return std::string(b, b + sizeof(b) / sizeof(char));
-            }
-            
-            throw ParseError("Unicode out of range.");
-        }
-
-        std::string parseHexEscape(int len)
-        {
-            assert(len <= 4);
-            char chars[4];
-            for (int i = 0; i < len; i++)
-            {
-                char c = next();
-                if (!isHexDigit(c))
-                {
-                    throw ParseError("Expected hex digit");
-                }
-                chars[i] = c;
-            }
-
-            return encodeUtf8((char32_t)parseHex(chars, len));
-        }
-
-        std::string parseDelimitedHexEscape()
-        {
-            expect('{');
-            std::string chars;
-            while (true)
-            {
-                if (peek() == '}')
-                {
-                    next();
-                    break;
-                }
-                else if (isHexDigit(peek()))
-                {
-                    if (chars.length() >= 6)
-                    {
-                        throw ParseError("Unicode escape sequence too long");
-                    }
-                    chars += next();
-                }
-                else
-                {
-                    throw ParseError("Expected hex digit");
-                }
-            }
-
-            return encodeUtf8((char32_t)parseHex(chars.c_str(), chars.size()));
-        }
-
-        std::string parseEscape()
-        {
-            switch (peek())
-            {
-            case '0':
-                return "\0";
-            case '\'':
-                return "\'";
-            case '"':
-                return "\"";
-            case '\\':
-                return "\\";
-            case 'n':
-                return "\n";
-            case 'r':
-                return "\r";
-            case 'v':
-                return "\v";
-            case 't':
-                return "\t";
-            case 'b':
-                return "\b";
-            case 'f':
-                return "\f";
-            case 'u':
-                next();
-                return peek() == '{' ? parseDelimitedHexEscape() : parseHexEscape(4);
-            case 'x':
-                next();
-                return parseHexEscape(2);
-            }
-            throw ParseError("Invalid escape sequence");
-        }
-
-        std::string parseAtom()
-        {
-            std::string result;
-            char delimiter = 0;
-            
-            if (peek() == '"' || peek() == '\'')
-            {
-                delimiter = next();
-            }
-
-            while (true)
-            {
-                if (delimiter != 0)
-                {
-                    if (peek() == delimiter)
-                    {
-                        next();
-                        break;
-                    }
-                }
-                else if (isNakedDelimiter(peek()))
-                {
-                    break;
-                }
-
-                char c = next();
-
-                if (delimiter != 0 && c == '\\')
-                {
-                    result += parseEscape();
-                }
-                else
-                {
-                    result += c;
-                }
-            }
-
-            return result;
-        }
-
-        Node parseMap()
-        {
-            expect('{');
-            
-            Node result;
-            std::string key;
-            
-            while (true) {
-                skipAir();
-                switch (peek())
-                {
-                case '}':
-                    next();
-                    return result;
-                case ',':
-                    next();
-                    break;
-                default:
-                    key = parseAtom();
-                    skipAir();
-                    expect('=', ':');
-                    result[std::move(key)] = parseNode();
-                    break;
-                }
-            }
-        }
-
-        Node parseVector()
-        {
-            expect('[');
-
-            Node result;
-
-            while (true) {
-                skipAir();
-                switch (peek())
-                {
-                case ']':
-                    next();
-                    return result;
-                case ',':
-                    next();
-                    break;
-                default:
-                    result.push_back(parseNode());
-                    break;
-                }
-            }
-        }
-
-        int peek()
-        {
-            return _stream.peek();
-        }
-
-        char next()
-        {
-            int c = _stream.get();
-            if (isEOF(c))
-            {
-                throw ParseError("Unexpected end of file");
-            }
-            return (char)c;
-        }
-
-        void expect(char c)
-        {
-            if (peek() != c)
-            {
-                throw ParseError(std::string("Expected '") + c + "'");
-            }
-            next();
-        }
-
-        void expect(char a, char b)
-        {
-            int c = peek();
-            if (c != a && c != b)
-            {
-                throw ParseError(std::string("Expected '") + a + "' or '" + b + "'");
-            }
-            next();
-        }
-
-        bool isWhitespace(int c)
-        {
-            return c == ' ' || c == '\t' || c == '\n' || c == '\r';
-        }
-
-        bool isHexDigit(int c)
-        {
-            return c >= 'a' && c <= 'f' || c >= 'A' && c <= 'F' || c >= '0' && c <= '9';
-        }
-
-        bool isEOF(int c)
-        {
-            return c == std::char_traits<char>::eof();
-        }
-
-        bool isNakedDelimiter(int c)
-        {
-            return isEOF(c) || isWhitespace(c) || c == ':' || c == '=' || c == '[' || c == ']' || c == '{' || c == '}' || c == '"' || c == '\'' || c == '/' || c == ',';
-        }
-
-        void skipAir()
-        {
-            while (true)
-            {
-                if (isWhitespace(peek()))
-                {
-                    next();
-                }
-                else if (peek() == '/') 
-                {
-                    next();
-                    if (peek() == '/')
-                    {
-                        next();
-                        skipLineComment();
-                    }
-                    else if (peek() == '*')
-                    {
-                        next();
-                        skipBlockComment();
-                    }
-                    else
-                    {
-                        throw ParseError("Unexpected character: '/'");
-                    }
-                }
-                else
-                {
-                    break;
-                }
-            }
-        }
-
-        void skipLineComment()
-        {
-            while (true)
-            {
-                if (peek() == '\n')
-                {
-                    next();
-                    return;
-                }
-                else if (isEOF(peek()))
-                {
-                    return;
-                }
-                else
-                {
-                    next();
-                }
-            }
-        }
-
-        void skipBlockComment()
-        {
-            int depth = 1;
-
-            while (depth > 0)
-            {
-                if (peek() == '*')
-                {
-                    next();
-                    if (peek() == '/')
-                    {
-                        depth -= 1;
-                    }
-                }
-                if (peek() == '/')
-                {
-                    next();
-                    if (peek() == '*')
-                    {
-                        depth += 1;
-                    }
-                }
-                else if (isEOF(peek()))
-                {
-                    return;
-                }
-                else
-                {
-                    next();
-                }
-            }
-        }
-
-        std::istream& _stream;
-    };
-
-    std::variant<Node, ParseError> decode(std::istream& s) {
-        try
-        {
-            Parser parser(s);
-            return parser.parseNode();
-        }
-        catch (ParseError& e)
-        {
-            return e;
-        }
-    }
-
-    std::variant<Node, ParseError> decode(const std::string& s) {
-        std::istringstream st(s);
-        return decode(st);
-    }
-}
+#include "decode.h"
+#include "node.h"
+#include "util.h"
+#include "memory.h"
+
+#include <sstream>
+#include <algorithm>
+#include <charconv>
+#include <cassert>
+
+namespace keson
+{
+    class Parser
+    {
+    public:
+        Parser(std::istream& stream, std::string& keyBuffer, uint32_t flags, const std::vector<Decoder::ArrayBinding>* bindings = nullptr)
+            : _stream(stream)
+            , _key(keyBuffer)
+            , _flags(flags)
+            , _bindings(bindings != nullptr && !bindings->empty() ? bindings : nullptr)
+        { }
+
+        Node parseNode()
+        {
+            Node result;
+            parseInto(result);
+            return result;
+        }
+
+        // Parses the next value into node, reusing the strings, vectors and maps it
+        // already holds wherever the new value has the same shape.
+        void parseInto(Node& node)
+        {
+            skipAir();
+            switch (peek())
+            {
+            case '{':
+                parseMapInto(node);
+                break;
+            case '[':
+                parseVectorInto(node);
+                break;
+            default:
+                if (!node.isAtom())
+                {
+                    node = std::string();
+                }
+                node.atom().clear();
+                parseAtom(node.atom());
+                break;
+            }
+        }
+
+    private:
+        uint32_t parseHex(const char* chars, int len)
+        {
+            uint32_t v;
+            auto result = std::from_chars(chars, chars + len, v, 16);
+            if (result.ec != (std::errc)0 || result.ptr != chars + len)
+            {
+                throw ParseError("Internal error when parsing hex");
+            }
+            return v;
+        }
+
+        std::string encodeUtf8(uint32_t v)
+        {
+            if (v < 0x7f)
+            {
+                return std::string(1, (char)v);
+            }
+            
+            if (v < 0x7ff)
+            {
+                char b[] = {
+                    0b1100'0000 | (char)(v >> 6),
+                    0b1000'0000 | (char)(v & 0b0011'1111)
+                };
+                return std::string(b, b + sizeof(b) / sizeof(char));
+            }
+            
+            if (v < 0xffff)
+            {
+                char b[] = {
+                    0b1110'0000 | (char)(v >> 12),
+                    0b1000'0000 | (char)((v >> 6) & 0b0011'1111),
+                    0b1000'0000 | (char)(v & 0b0011'1111)
+                };
+                return std::string(b, b + sizeof(b) / sizeof(char));
+            }
+            
+            if (v < 0x10ffff)
+            {
+                char b[] = {
+                    0b1111'0000 | (char)(v >> 18),
+                    0b1000'0000 | (char)((v >> 12) & 0b0011'1111),
+                    0b1000'0000 | (char)((v >> 6) & 0b0011'1111),
+                    0b1000'0000 | (char)(v & 0b0011'1111)
+                };
+                return std::string(b, b + sizeof(b) / sizeof(char));
+            }
+            
+            throw ParseError("Unicode out of range.");
+        }
+
+        std::string parseHexEscape(int len)
+        {
+            assert(len <= 4);
+            char chars[4];
+            for (int i = 0; i < len; i++)
+            {
+                char c = next();
+                if (!isHexDigit(c))
+                {
+                    throw ParseError("Expected hex digit");
+                }
+                chars[i] = c;
+            }
+
+            return encodeUtf8((char32_t)parseHex(chars, len));
+        }
+
+        std::string parseDelimitedHexEscape()
+        {
+            expect('{');
+            std::string chars;
+            while (true)
+            {
+                if (peek() == '}')
+                {
+                    next();
+                    break;
+                }
+                else if (isHexDigit(peek()))
+                {
+                    if (chars.length() >= 6)
+                    {
+                        throw ParseError("Unicode escape sequence too long");
+                    }
+                    chars += next();
+                }
+                else
+                {
+                    throw ParseError("Expected hex digit");
+                }
+            }
+
+            return encodeUtf8((char32_t)parseHex(chars.c_str(), chars.size()));
+        }
+
+        std::string parseEscape()
+        {
+            switch (peek())
+            {
+            case '0':
+                return "\0";
+            case '\'':
+                return "\'";
+            case '"':
+                return "\"";
+            case '\\':
+                return "\\";
+            case 'n':
+                return "\n";
+            case 'r':
+                return "\r";
+            case 'v':
+                return "\v";
+            case 't':
+                return "\t";
+            case 'b':
+                return "\b";
+            case 'f':
+                return "\f";
+            case 'u':
+                next();
+                return peek() == '{' ? parseDelimitedHexEscape() : parseHexEscape(4);
+            case 'x':
+                next();
+                return parseHexEscape(2);
+            }
+            throw ParseError("Invalid escape sequence");
+        }
+
+        void parseAtom(std::string& result)
+        {
+            char delimiter = 0;
+            
+            if (peek() == '"' || peek() == '\'')
+            {
+                delimiter = next();
+            }
+
+            while (true)
+            {
+                if (delimiter != 0)
+                {
+                    if (peek() == delimiter)
+                    {
+                        next();
+                        break;
+                    }
+                }
+                else if (isNakedDelimiter(peek()))
+                {
+                    break;
+                }
+
+                char c = next();
+
+                if (delimiter != 0 && c == '\\')
+                {
+                    result += parseEscape();
+                }
+                else
+                {
+                    result += c;
+                }
+            }
+        }
+
+        // Entries are kept in document order: each key found is swapped into the next
+        // position, and entries that were not seen again are dropped at the end.
+        void parseMapInto(Node& node)
+        {
+            expect('{');
+
+            if (!node.isMap())
+            {
+                node = Node::Map();
+            }
+            Node::Map& map = node.map();
+            size_t count = 0;
+
+            while (true) {
+                skipAir();
+                switch (peek())
+                {
+                case '}':
+                    next();
+                    map.erase(map.begin() + count, map.end());
+                    if (count == 0)
+                    {
+                        node = Node();
+                    }
+                    return;
+                case ',':
+                    next();
+                    break;
+                default:
+                    {
+                        _key.clear();
+                        parseAtom(_key);
+                        skipAir();
+                        expect('=', ':');
+
+                        if (_bindings != nullptr)
+                        {
+                            if (const Decoder::ArrayBinding* binding = findBinding())
+                            {
+                                skipAir();
+                                parseBoundArray(*binding);
+                                break;
+                            }
+                            _path.push_back(_key);
+                        }
+
+                        auto it = map.find(_key);
+                        if (it == map.end())
+                        {
+                            it = map.try_emplace(_key).first;
+                        }
+                        size_t pos = it - map.begin();
+                        if (pos >= count)
+                        {
+                            map.swapEntries(pos, count);
+                            pos = count++;
+                        }
+                        parseInto((map.begin() + pos)->second);
+
+                        if (_bindings != nullptr)
+                        {
+                            _path.pop_back();
+                        }
+                    }
+                    break;
+                }
+            }
+        }
+
+        void parseVectorInto(Node& node)
+        {
+            expect('[');
+
+            size_t count = 0;
+            _vectorDepth++;
+            if ((_flags & Decode_PACK_NUMERIC_VECTORS) != 0)
+            {
+                if (parsePackedInto(node, count))
+                {
+                    _vectorDepth--;
+                    return;
+                }
+            }
+            else if (!node.isVector())
+            {
+                node = Node::Vector();
+            }
+            Node::Vector& vector = node.vector();
+
+            while (true) {
+                skipAir();
+                switch (peek())
+                {
+                case ']':
+                    next();
+                    _vectorDepth--;
+                    vector.resize(count);
+                    if (count == 0)
+                    {
+                        node = Node();
+                    }
+                    return;
+                case ',':
+                    next();
+                    break;
+                case ':':
+                case '=':
+                case '}':
+                    throw ParseError(std::string("Unexpected character: '") + (char)peek() + "'");
+                default:
+                    if (isEOF(peek()))
+                    {
+                        throw ParseError("Unexpected end of file");
+                    }
+                    if (count == vector.size())
+                    {
+                        vector.emplace_back();
+                    }
+                    parseInto(vector[count++]);
+                    break;
+                }
+            }
+        }
+
+        // True if the atom just parsed is the text encode would write for v
+        template<typename T>
+        bool isCanonical(T v)
+        {
+            char text[32];
+            auto result = std::to_chars(text, text + sizeof(text), v);
+            return result.ec == (std::errc)0 && std::string_view(text, result.ptr - text) == _atom;
+        }
+
+        // True if v is written the same way as an integer and as a double
+        static bool isIntegralDouble(int64_t v)
+        {
+            char a[32];
+            char b[32];
+            auto ra = std::to_chars(a, a + sizeof(a), v);
+            auto rb = std::to_chars(b, b + sizeof(b), (double)v);
+            return std::string_view(a, ra.ptr - a) == std::string_view(b, rb.ptr - b);
+        }
+
+        // Reads numbers in canonical form into a packed array. At the first element that
+        // is anything else, the numbers read so far and an atom just parsed are put into
+        // node as a normal vector of count elements, and false is returned for the
+        // caller to carry on from there.
+        bool parsePackedInto(Node& node, size_t& count)
+        {
+            std::vector<int64_t> ints;
+            std::vector<double> doubles;
+            bool isDouble = false;
+            bool pending = false;
+
+            while (true)
+            {
+                skipAir();
+                int c = peek();
+                if (c == ']')
+                {
+                    next();
+                    if (isDouble)
+                    {
+                        node = Node(std::move(doubles));
+                    }
+                    else if (!ints.empty())
+                    {
+                        node = Node(std::move(ints));
+                    }
+                    else
+                    {
+                        node = Node();
+                    }
+                    return true;
+                }
+                if (c == ',')
+                {
+                    next();
+                    continue;
+                }
+                if (c != '"' && c != '\'' && isNakedDelimiter(c))
+                {
+                    break;
+                }
+
+                _atom.clear();
+                parseAtom(_atom);
+                if (!isDouble)
+                {
+                    auto v = try_from_string<int64_t>(_atom);
+                    if (v && isCanonical(*v))
+                    {
+                        ints.push_back(*v);
+                        continue;
+                    }
+                }
+                auto v = try_from_string<double>(_atom);
+                if (!v || !isCanonical(*v))
+                {
+                    pending = true;
+                    break;
+                }
+                if (!isDouble)
+                {
+                    if (!std::all_of(ints.begin(), ints.end(), isIntegralDouble))
+                    {
+                        pending = true;
+                        break;
+                    }
+                    doubles.assign(ints.begin(), ints.end());
+                    isDouble = true;
+                }
+                doubles.push_back(*v);
+            }
+
+            if (!node.isVector())
+            {
+                node = Node::Vector();
+            }
+            Node::Vector& vector = node.vector();
+            size_t n = isDouble ? doubles.size() : ints.size();
+            count = n + pending;
+            if (vector.size() < count)
+            {
+                vector.resize(count);
+            }
+            for (size_t i = 0; i < n; i++)
+            {
+                vector[i] = isDouble ? Node(doubles[i]) : Node(ints[i]);
+            }
+            if (pending)
+            {
+                vector[n] = _atom;
+            }
+            return false;
+        }
+
+        // Returns the binding for the key just parsed, if any
+        const Decoder::ArrayBinding* findBinding()
+        {
+            if (_vectorDepth > 0)
+            {
+                return nullptr;
+            }
+            for (auto& binding : *_bindings)
+            {
+                if (binding.path.size() == _path.size() + 1
+                    && binding.path.back() == _key
+                    && std::equal(_path.begin(), _path.end(), binding.path.begin()))
+                {
+                    return &binding;
+                }
+            }
+            return nullptr;
+        }
+
+        void parseBoundArray(const Decoder::ArrayBinding& binding)
+        {
+            expect('[');
+            size_t count = 0;
+
+            while (true) {
+                skipAir();
+                switch (peek())
+                {
+                case ']':
+                    next();
+                    *binding.count = count;
+                    return;
+                case ',':
+                    next();
+                    break;
+                default:
+                    if (isEOF(peek()))
+                    {
+                        throw ParseError("Unexpected end of file");
+                    }
+                    if (count == binding.capacity)
+                    {
+                        throw ParseError("Too many elements for bound array");
+                    }
+                    _atom.clear();
+                    parseAtom(_atom);
+                    if (_atom.empty() || !binding.store(binding.buffer, count, _atom))
+                    {
+                        throw ParseError("Expected a number in bound array: '" + _atom + "'");
+                    }
+                    count++;
+                    break;
+                }
+            }
+        }
+
+        int peek()
+        {
+            return _stream.peek();
+        }
+
+        char next()
+        {
+            int c = _stream.get();
+            if (isEOF(c))
+            {
+                throw ParseError("Unexpected end of file");
+            }
+            return (char)c;
+        }
+
+        void expect(char c)
+        {
+            if (peek() != c)
+            {
+                throw ParseError(std::string("Expected '") + c + "'");
+            }
+            next();
+        }
+
+        void expect(char a, char b)
+        {
+            int c = peek();
+            if (c != a && c != b)
+            {
+                throw ParseError(std::string("Expected '") + a + "' or '" + b + "'");
+            }
+            next();
+        }
+
+        bool isWhitespace(int c)
+        {
+            return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+        }
+
+        bool isHexDigit(int c)
+        {
+            return c >= 'a' && c <= 'f' || c >= 'A' && c <= 'F' || c >= '0' && c <= '9';
+        }
+
+        bool isEOF(int c)
+        {
+            return c == std::char_traits<char>::eof();
+        }
+
+        bool isNakedDelimiter(int c)
+        {
+            return isEOF(c) || isWhitespace(c) || c == ':' || c == '=' || c == '[' || c == ']' || c == '{' || c == '}' || c == '"' || c == '\'' || c == '/' || c == ',';
+        }
+
+        void skipAir()
+        {
+            while (true)
+            {
+                if (isWhitespace(peek()))
+                {
+                    next();
+                }
+                else if (peek() == '/') 
+                {
+                    next();
+                    if (peek() == '/')
+                    {
+                        next();
+                        skipLineComment();
+                    }
+                    else if (peek() == '*')
+                    {
+                        next();
+                        skipBlockComment();
+                    }
+                    else
+                    {
+                        throw ParseError("Unexpected character: '/'");
+                    }
+                }
+                else
+                {
+                    break;
+                }
+            }
+        }
+
+        void skipLineComment()
+        {
+            while (true)
+            {
+                if (peek() == '\n')
+                {
+                    next();
+                    return;
+                }
+                else if (isEOF(peek()))
+                {
+                    return;
+                }
+                else
+                {
+                    next();
+                }
+            }
+        }
+
+        void skipBlockComment()
+        {
+            int depth = 1;
+
+            while (depth > 0)
+            {
+                if (peek() == '*')
+                {
+                    next();
+                    if (peek() == '/')
+                    {
+                        depth -= 1;
+                    }
+                }
+                if (peek() == '/')
+                {
+                    next();
+                    if (peek() == '*')
+                    {
+                        depth += 1;
+                    }
+                }
+                else if (isEOF(peek()))
+                {
+                    return;
+                }
+                else
+                {
+                    next();
+                }
+            }
+        }
+
+        std::istream& _stream;
+        std::string& _key;
+        uint32_t _flags;
+
+        const std::vector<Decoder::ArrayBinding>* _bindings;
+        std::vector<std::string> _path;
+        int _vectorDepth = 0;
+        std::string _atom;
+    };
+
+    // Reads directly from a string without copying it into a stringbuf.
+    class MemoryBuffer : public std::streambuf
+    {
+    public:
+        MemoryBuffer(const std::string& s)
+        {
+            char* p = const_cast<char*>(s.data());
+            setg(p, p, p + s.size());
+        }
+    };
+
+    std::variant<Node, ParseError> decode(std::istream& s, uint32_t flags) {
+        try
+        {
+            std::string keyBuffer;
+            Parser parser(s, keyBuffer, flags);
+            Node result = parser.parseNode();
+#if KESON_ENABLE_MEMORY_COUNTER
+            memoryCounter() += (int64_t)memoryUsage(result).withoutCache();
+#endif
+            return result;
+        }
+        catch (ParseError& e)
+        {
+            return e;
+        }
+    }
+
+    std::variant<Node, ParseError> decode(const std::string& s, uint32_t flags) {
+        MemoryBuffer buffer(s);
+        std::istream st(&buffer);
+        return decode(st, flags);
+    }
+
+    std::optional<ParseError> Decoder::decodeInto(Node& node, std::istream& s) {
+        for (auto& binding : _bindings)
+        {
+            *binding.count = 0;
+        }
+#if KESON_ENABLE_MEMORY_COUNTER
+        // Also counted after an error, since the tree may have changed anyway
+        int64_t before = (int64_t)memoryUsage(node).withoutCache();
+        struct CountChange
+        {
+            ~CountChange() { memoryCounter() += (int64_t)memoryUsage(node).withoutCache() - before; }
+            const Node& node;
+            int64_t before;
+        } countChange { node, before };
+#endif
+        try
+        {
+            Parser parser(s, _keyBuffer, _flags, &_bindings);
+            parser.parseInto(node);
+            return std::nullopt;
+        }
+        catch (ParseError& e)
+        {
+            return e;
+        }
+    }
+
+    std::optional<ParseError> Decoder::decodeInto(Node& node, const std::string& s) {
+        MemoryBuffer buffer(s);
+        std::istream st(&buffer);
+        return decodeInto(node, st);
+    }
+
+    template<typename T>
+    void Decoder::bindArray(std::vector<std::string> path, T* buffer, size_t capacity, size_t& count) {
+        auto store = [](void* buffer, size_t index, std::string_view atom) {
+            auto value = try_from_string<T>(atom);
+            if (value)
+            {
+                static_cast<T*>(buffer)[index] = *value;
+            }
+            return value.has_value();
+        };
+        _bindings.push_back({ std::move(path), buffer, capacity, &count, store });
+    }
+
+    template void Decoder::bindArray<int8_t>(std::vector<std::string> path, int8_t* buffer, size_t capacity, size_t& count);
+    template void Decoder::bindArray<uint8_t>(std::vector<std::string> path, uint8_t* buffer, size_t capacity, size_t& count);
+    template void Decoder::bindArray<int16_t>(std::vector<std::string> path, int16_t* buffer, size_t capacity, size_t& count);
+    template void Decoder::bindArray<uint16_t>(std::vector<std::string> path, uint16_t* buffer, size_t capacity, size_t& count);
+    template void Decoder::bindArray<int32_t>(std::vector<std::string> path, int32_t* buffer, size_t capacity, size_t& count);
+    template void Decoder::bindArray<uint32_t>(std::vector<std::string> path, uint32_t* buffer, size_t capacity, size_t& count);
+    template void Decoder::bindArray<int64_t>(std::vector<std::string> path, int64_t* buffer, size_t capacity, size_t& count);
+    template void Decoder::bindArray<uint64_t>(std::vector<std::string> path, uint64_t* buffer, size_t capacity, size_t& count);
+    template void Decoder::bindArray<float>(std::vector<std::string> path, float* buffer, size_t capacity, size_t& count);
+    template void Decoder::bindArray<double>(std::vector<std::string> path, double* buffer, size_t capacity, size_t& count);
+}
@@ -1,32 +1,88 @@
-#pragma once
-
-#include <string>
-#include <istream>
-
-#include "conf.h"
-#include "node.h"
-
-namespace keson
-{
-    class ParseError
-    {
-    public:
-        // TODO: Add line and column number to this exception
-
-        ParseError(const std::string& message)
-            : _message(message)
-        { }
-
-        const std::string& what()
-        {
-            return _message;
-        }
-
-    private:
-        std::string _message;
-    };
-
-    std::variant<Node, ParseError> decode(std::istream& s);
-    
-    std::variant<Node, ParseError> decode(const std::string& s);
-}
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <istream>
+#include <optional>
+#include <cstdint>
+
+#include "conf.h"
+#include "node.h"
+
+namespace keson
+{
+    class ParseError
+    {
+    public:
+        // TODO: Add line and column number to this exception
+
+        ParseError(const std::string& message)
+            : _message(message)
+        { }
+
+        const std::string& what()
+        {
+            return _message;
+        }
+
+    private:
+        std::string _message;
+    };
+
+    // Decode vectors whose elements are all integers, or all numbers, written in the
+    // form encode would write them as packed arrays of int64_t or double. Other
+    // spellings such as 1.0, 1e3 or 0x10 keep the vector unpacked, so no number
+    // changes how it is written. Quoted numbers are packed too, since with
+    // Flag_QUOTE_STRING_VALUES encode quotes packed elements just as it does atoms.
+    static const uint32_t Decode_PACK_NUMERIC_VECTORS = (1 << 0);
+
+    std::variant<Node, ParseError> decode(std::istream& s, uint32_t flags = 0);
+    
+    std::variant<Node, ParseError> decode(const std::string& s, uint32_t flags = 0);
+
+    // Decodes into an existing tree so that repeated decoding of similar documents can
+    // reuse its allocations: atoms are parsed into the strings already there, vector
+    // elements and map entries are decoded in place where the shapes match, and only
+    // what no longer appears is freed. The result is the same as decode would give.
+    //
+    // On error the node is left partially updated.
+    class Decoder
+    {
+    public:
+        explicit Decoder(uint32_t flags = 0)
+            : _flags(flags)
+        { }
+
+        std::optional<ParseError> decodeInto(Node& node, std::istream& s);
+
+        std::optional<ParseError> decodeInto(Node& node, const std::string& s);
+
+        // Decodes the vector found at path, a sequence of map keys from the root, straight
+        // into buffer instead of creating child nodes, and sets count to the number of
+        // elements read. The key is left out of the decoded tree and count is zero if it
+        // does not appear. Anything but a vector of at most capacity valid T values there
+        // is a parse error. Vectors inside other vectors are not matched.
+        //
+        // The buffer must stay valid for as long as the decoder is used.
+        template<typename T>
+        void bindArray(std::vector<std::string> path, T* buffer, size_t capacity, size_t& count);
+
+    private:
+        friend class Parser;
+
+        struct ArrayBinding
+        {
+            std::vector<std::string> path;
+            void* buffer;
+            size_t capacity;
+            size_t* count;
+            // Converts atom and stores it at index, returning false if it is not valid
+            bool (*store)(void* buffer, size_t index, std::string_view atom);
+        };
+
+        uint32_t _flags;
+        std::string _keyBuffer;
+        std::vector<ArrayBinding> _bindings;
+    };
+}
@@ -0,0 +1,274 @@
+#include "diff.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace keson
+{
+    static void diffInto(const Node& a, const Node& b, Path& path, Patch& patch);
+
+    // Packed arrays are edited as vectors, which the mutable accessors unpack them into
+    static bool isVectorLike(const Node& node) {
+        return node.isVector() || node.isPacked();
+    }
+
+    // Different hashes rule out equality cheaply, but equal ones could still be a
+    // collision, so they are confirmed by comparing the nodes
+    static bool same(const Node& a, const Node& b) {
+        return a.hash() == b.hash() && a == b;
+    }
+
+    static void diffMaps(const Node& a, const Node& b, Path& path, Patch& patch) {
+        for (auto& keyChild : a.map()) {
+            if (!keyChild.second.isNull() && b[keyChild.first].isNull()) {
+                path.emplace_back(keyChild.first);
+                patch.push_back({ PatchOp::Type_REMOVE, path, Node() });
+                path.pop_back();
+            }
+        }
+
+        for (auto& keyChild : b.map()) {
+            if (keyChild.second.isNull()) {
+                continue;
+            }
+            path.emplace_back(keyChild.first);
+            const Node& old = a[keyChild.first];
+            if (old.isNull()) {
+                patch.push_back({ PatchOp::Type_SET, path, Node(keyChild.second) });
+            }
+            else {
+                diffInto(old, keyChild.second, path, patch);
+            }
+            path.pop_back();
+        }
+    }
+
+    static void diffVectors(const Node& a, const Node& b, Path& path, Patch& patch) {
+        auto& va = a.vector();
+        auto& vb = b.vector();
+
+        size_t prefix = 0;
+        while (prefix < va.size() && prefix < vb.size() && same(va[prefix], vb[prefix])) {
+            prefix++;
+        }
+
+        size_t suffix = 0;
+        while (suffix < va.size() - prefix && suffix < vb.size() - prefix
+            && same(va[va.size() - 1 - suffix], vb[vb.size() - 1 - suffix])) {
+            suffix++;
+        }
+
+        // Walk the changed middle, recognising single insertions and removals by looking
+        // one element ahead and diffing the remaining pairs in place. index is the
+        // position in the vector as patched so far.
+        size_t i = prefix;
+        size_t j = prefix;
+        size_t endA = va.size() - suffix;
+        size_t endB = vb.size() - suffix;
+        size_t index = prefix;
+
+        while (i < endA || j < endB) {
+            path.emplace_back(index);
+            if (i < endA && j < endB && same(va[i], vb[j])) {
+                i++;
+                j++;
+                index++;
+            }
+            else if (j < endB && (i == endA || (j + 1 < endB && same(va[i], vb[j + 1])))) {
+                patch.push_back({ PatchOp::Type_INSERT, path, Node(vb[j]) });
+                j++;
+                index++;
+            }
+            else if (i < endA && (j == endB || (i + 1 < endA && same(va[i + 1], vb[j])))) {
+                patch.push_back({ PatchOp::Type_REMOVE, path, Node() });
+                i++;
+            }
+            else {
+                diffInto(va[i], vb[j], path, patch);
+                i++;
+                j++;
+                index++;
+            }
+            path.pop_back();
+        }
+    }
+
+    static void diffInto(const Node& a, const Node& b, Path& path, Patch& patch) {
+        if (same(a, b)) {
+            return;
+        }
+
+        if (a.isMap() && b.isMap()) {
+            diffMaps(a, b, path, patch);
+        }
+        else if (a.isVector() && b.isVector()) {
+            diffVectors(a, b, path, patch);
+        }
+        else {
+            patch.push_back({ PatchOp::Type_SET, path, Node(b) });
+        }
+    }
+
+    Patch diff(const Node& a, const Node& b) {
+        Patch patch;
+        Path path;
+        diffInto(a, b, path, patch);
+        return patch;
+    }
+
+    // Follows all but the last step of path. With create set, missing maps, vectors
+    // and elements are created on the way like the mutable Node accessors do.
+    static Node* resolveParent(Node& root, const Path& path, bool create) {
+        Node* node = &root;
+        for (size_t i = 0; i + 1 < path.size(); i++) {
+            if (auto key = std::get_if<std::string>(&path[i])) {
+                if (create && (node->isNull() || node->isMap())) {
+                    node = &(*node)[*key];
+                }
+                else {
+                    node = node->find(*key);
+                }
+            }
+            else {
+                size_t index = std::get<size_t>(path[i]);
+                if (create && (node->isNull() || isVectorLike(*node))) {
+                    node = &(*node)[index];
+                }
+                else {
+                    node = (isVectorLike(*node) && index < node->length()) ? &node->vector()[index] : nullptr;
+                }
+            }
+
+            if (node == nullptr) {
+                return nullptr;
+            }
+        }
+        return node;
+    }
+
+    static bool applyOp(Node& root, const PatchOp& op) {
+        if (op.path.empty()) {
+            if (op.type != PatchOp::Type_SET) {
+                return false;
+            }
+            root = op.value;
+            return true;
+        }
+
+        Node* parent = resolveParent(root, op.path, op.type != PatchOp::Type_REMOVE);
+        if (parent == nullptr) {
+            return false;
+        }
+
+        const PathStep& last = op.path.back();
+        auto key = std::get_if<std::string>(&last);
+
+        switch (op.type) {
+        case PatchOp::Type_SET:
+            if (key != nullptr) {
+                if (!parent->isNull() && !parent->isMap()) { return false; }
+                (*parent)[*key] = op.value;
+            }
+            else {
+                if (!parent->isNull() && !isVectorLike(*parent)) { return false; }
+                (*parent)[std::get<size_t>(last)] = op.value;
+            }
+            return true;
+
+        case PatchOp::Type_REMOVE:
+            if (key != nullptr) {
+                return parent->isMap() && parent->map().erase(*key) > 0;
+            }
+            else {
+                size_t index = std::get<size_t>(last);
+                if (!isVectorLike(*parent) || index >= parent->length()) { return false; }
+                auto& v = parent->vector();
+                v.erase(v.begin() + index);
+                return true;
+            }
+
+        case PatchOp::Type_INSERT: {
+            if (key != nullptr || (!parent->isNull() && !isVectorLike(*parent))) { return false; }
+            size_t index = std::get<size_t>(last);
+            auto& v = parent->vector();
+            if (index > v.size()) { return false; }
+            v.insert(v.begin() + index, op.value);
+            return true;
+        }
+        }
+        return false;
+    }
+
+    bool apply(Node& node, const Patch& patch) {
+        bool ok = true;
+        for (auto& op : patch) {
+            ok &= applyOp(node, op);
+        }
+        return ok;
+    }
+
+    static const char* OP_NAMES[] = { "set", "remove", "insert" };
+
+    Node patchToNode(const Patch& patch) {
+        Node result = Node::Vector();
+        for (auto& op : patch) {
+            Node& n = result.push_back();
+            n["op"] = OP_NAMES[op.type];
+            Node& path = n["path"] = Node::Vector();
+            for (auto& step : op.path) {
+                if (auto key = std::get_if<std::string>(&step)) {
+                    path.push_back(*key);
+                }
+                else {
+                    path.push_back(Node(Node::Vector{ Node((uint64_t)std::get<size_t>(step)) }));
+                }
+            }
+            if (op.type != PatchOp::Type_REMOVE) {
+                n["value"] = op.value;
+            }
+        }
+        return result;
+    }
+
+    std::variant<Patch, ParseError> patchFromNode(const Node& node) {
+        if (!node.isNull() && !node.isVector()) {
+            return ParseError("Expected a vector of patch operations");
+        }
+
+        Patch patch;
+        for (auto& n : node) {
+            PatchOp op;
+
+            const Node& name = n["op"];
+            auto type = name.isAtom() ? std::find(std::begin(OP_NAMES), std::end(OP_NAMES), name.atom()) : std::end(OP_NAMES);
+            if (type == std::end(OP_NAMES)) {
+                return ParseError("Expected op to be set, remove or insert");
+            }
+            op.type = (PatchOp::Type)(type - std::begin(OP_NAMES));
+
+            const Node& path = n["path"];
+            if (!path.isNull() && !path.isVector()) {
+                return ParseError("Expected path to be a vector");
+            }
+            for (auto& step : path) {
+                if (step.isAtom()) {
+                    op.path.emplace_back(step.atom());
+                }
+                else if (step.isVector() && step.length() == 1 && step.vector()[0].isAtom()) {
+                    auto index = step.vector()[0].try_get<uint64_t>();
+                    if (!index) {
+                        return ParseError("Invalid index in patch path: " + step.vector()[0].atom());
+                    }
+                    op.path.emplace_back((size_t)*index);
+                }
+                else {
+                    return ParseError("Expected path steps to be keys or [index]");
+                }
+            }
+
+            op.value = n["value"];
+            patch.push_back(std::move(op));
+        }
+        return patch;
+    }
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <variant>
+#include <cstdint>
+
+#include "conf.h"
+#include "node.h"
+#include "decode.h"
+
+namespace keson
+{
+    // One step into a tree: a map key or a vector index.
+    using PathStep = std::variant<std::string, size_t>;
+    using Path = std::vector<PathStep>;
+
+    struct PatchOp {
+        enum Type {
+            // Replace the node at path with value, creating missing parents
+            Type_SET,
+            // Remove the map entry or vector element at path
+            Type_REMOVE,
+            // Insert value into a vector before the index at the end of path
+            Type_INSERT,
+        };
+
+        Type type;
+        Path path;
+        // A copy of its own, so that writes to the trees it came from or goes into
+        // do not reach it
+        Node value;
+    };
+
+    // Operations are applied in order, so each path refers to the tree as left by the
+    // operations before it.
+    using Patch = std::vector<PatchOp>;
+
+    // Computes a patch that turns a into b. Subtrees with equal structural hashes are
+    // compared and, when equal, skipped without producing operations. Only containers
+    // sealed by Node::snapshot() keep their hashes (see Node::hash()), so a small edit
+    // to a large document costs about as much as the edit when both trees were
+    // snapshotted before it. Trees that were never snapshotted are rehashed at every
+    // level, which costs their size times their depth. Neither tree is sealed or
+    // shared with the patch.
+    //
+    // Vectors are matched by trimming their common prefix and suffix and then looking
+    // one element ahead, which turns isolated insertions and removals into single
+    // operations instead of a rewrite of every element after them.
+    Patch diff(const Node& a, const Node& b);
+
+    // Applies the operations in order. Returns false if any operation did not fit the
+    // tree, such as removing a missing key; the remaining operations are still applied.
+    // Call it qualified, since a Patch argument also brings std::apply into lookup.
+    bool apply(Node& node, const Patch& patch);
+
+    // Converts a patch to and from a Node so it can be sent through encode and decode.
+    // Each operation becomes a map of op, path and value, with vector indices written
+    // as single element vectors in the path.
+    Node patchToNode(const Patch& patch);
+
+    std::variant<Patch, ParseError> patchFromNode(const Node& node);
+}
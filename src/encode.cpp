@@ -1,301 +1,532 @@
-#include "encode.h"
-#include "node.h"
-#include "util.h"
-
-#include <cassert>
-#include <sstream>
-
-namespace keson
-{
-    inline MapWriter::~MapWriter() {
-        _parent->_depth -= 1;
-        if (!_first) {
-            _parent->printNewline();
-        }
-        _parent->_stream << "}";
-    }
-
-    Writer& MapWriter::operator[](const std::string& key) {
-        if (!_first) {
-            _parent->_stream << ",";
-        }
-        _first = false;
-        _parent->printNewline();
-        _parent->printKey(key);
-        return *_parent;
-    }
-
-    inline MapWriter::MapWriter(Writer* parent) : _parent(parent) {
-        _parent->_stream << "{";
-        _parent->_depth += 1;
-    }
-
-    inline VectorWriter::~VectorWriter() {
-        _parent->_depth -= 1;
-        if (!_first) {
-            _parent->printNewline();
-        }
-        _parent->_stream << "]";
-    }
-
-    inline Writer& VectorWriter::next() {
-        if (!_first) {
-            _parent->_stream << ",";
-        }
-        _first = false;
-        _parent->printNewline();
-        return *_parent;
-    }
-
-    inline VectorWriter::VectorWriter(Writer* parent) : _parent(parent) {
-        _parent->_stream << "[";
-        _parent->_depth += 1;
-    }
-
-    inline Writer::Writer(std::ostream& stream, uint32_t flags)
-        : _stream(stream)
-        , _flags(flags)
-        , _depth(0)
-    { }
-
-    inline VectorWriter Writer::vector() {
-        return VectorWriter(this);
-    }
-
-    inline MapWriter Writer::map() {
-        return MapWriter(this);
-    }
-    
-    void Writer::operator=(const std::string& value)  { printString(value); }
-    void Writer::operator=(int8_t value)              { printNumeric(to_string(value)); }
-    void Writer::operator=(uint8_t value)             { printNumeric(to_string(value)); }
-    void Writer::operator=(int16_t value)             { printNumeric(to_string(value)); }
-    void Writer::operator=(uint16_t value)            { printNumeric(to_string(value)); }
-    void Writer::operator=(int32_t value)             { printNumeric(to_string(value)); }
-    void Writer::operator=(uint32_t value)            { printNumeric(to_string(value)); }
-    void Writer::operator=(int64_t value)             { printNumeric(to_string(value)); }
-    void Writer::operator=(uint64_t value)            { printNumeric(to_string(value)); }
-    void Writer::operator=(float value)               { printNumeric(to_string(value)); }
-    void Writer::operator=(double value)              { printNumeric(to_string(value)); }
-    void Writer::operator=(bool value)                { printBoolean(to_string(value)); }
-#if KESON_ENABLE_WSTRING
-    void Writer::operator=(const std::wstring& value) { printString(to_utf8(value)); }
-#endif
-
-    inline void Writer::printNewline() {
-        if ((_flags & Flag_PRETTY_PRINT) == 0) { return; }
-        if ((_flags & Flag_CRLF_NEWLINES) != 0) {
-            _stream << "\r\n";
-        }
-        else {
-            _stream << '\n';
-        }
-        for (uint32_t i = 0; i < _depth; i++) {
-            if ((_flags & Flag_INDENT_WITH_SPACES) != 0) {
-                _stream << "    ";
-            }
-            else {
-                _stream << '\t';
-            }
-        }
-    }
-
-    void Writer::printComment(const std::string& value)
-    {
-        if ((_flags & Flag_PRETTY_PRINT) == 0) { return; }
-        _stream << "/* " << value << " */";
-    }
-
-#if KESON_ENABLE_WSTRING
-    void Writer::printComment(const std::wstring& value) { printComment(to_utf8(value)); }
-#endif
-
-    inline void Writer::printKey(const std::string& value) {
-        if ((_flags & Flag_QUOTE_KEYS) != 0) {
-            printQuoted(value);
-        } else {
-            printCleanIfPossible(value);
-        }
-
-        if ((_flags & Flag_PRETTY_PRINT) != 0) {
-            _stream << ": ";
-        } else {
-            _stream << ':';
-        }
-    }
-
-    inline void Writer::printString(const std::string& value) {
-        if ((_flags & Flag_QUOTE_STRING_VALUES) != 0) {
-            printQuoted(value);
-        }
-        else {
-            printCleanIfPossible(value);
-        }
-    }
-
-    inline void Writer::printNumeric(const std::string& value) {
-        if ((_flags & Flag_QUOTE_NUMERIC_VALUES) != 0) {
-            printQuoted(value);
-        }
-        else {
-            printClean(value);
-        }
-    }
-
-    inline void Writer::printBoolean(const std::string& value) {
-        if ((_flags & Flag_QUOTE_BOOLEAN_VALUES) != 0) {
-            printQuoted(value);
-        }
-        else {
-            printClean(value);
-        }
-    }
-
-    inline bool Writer::isClean(const std::string& value) {
-        if (value.empty()) { return false; }
-        const char EXTENDED_SAFE_CHARS[] = "-+=.@$/\\?!#*";
-        bool allowExtended = ((_flags & Flag_EXTENDED_SAFE_CHARS) != 0);
-        bool commentStarting = false;
-        for (char c : value) {
-            bool ucase = ('A' <= c && c <= 'Z');
-            bool lcase = ('a' <= c && c <= 'z');
-            bool digit = ('0' <= c && c <= '9');
-            bool underscore = (c == '_');
-            bool extended = false;
-            if (allowExtended) {
-                extended = strchr(EXTENDED_SAFE_CHARS, c) != nullptr;
-                if (commentStarting && (c == '/' || c == '*')) {
-                    return false;
-                }
-                commentStarting = (c == '/');
-            }
-            if (!ucase && !lcase && !digit && !underscore && !extended) {
-                return false;
-            }
-        }
-        return true;
-    }
-
-    inline void Writer::printCleanIfPossible(const std::string& value) {
-        if (isClean(value)) {
-            printClean(value);
-        }
-        else {
-            printQuoted(value);
-        }
-    }
-
-    inline void Writer::printClean(const std::string& value) {
-        _stream << value;
-    }
-
-    inline char Writer::decideQuoteChar(const std::string& value) {
-        char preferredQuotes = ((_flags & Flag_PREFER_SINGLE_QUOTES) != 0) ? '\'' : '"';
-        if ((_flags & Flag_FLEXIBLE_QUOTES) == 0) {
-            return preferredQuotes;
-        }
-
-        bool seenSingle = false;
-        bool seenDouble = false;
-
-        for (char c : value) {
-            seenSingle |= (c == '\'');
-            seenDouble |= (c == '"');
-            if (seenSingle && seenDouble) {
-                return preferredQuotes;
-            }
-        }
-
-        if (!seenSingle && !seenDouble) {
-            return preferredQuotes;
-        } if (seenSingle) {
-            return '"';
-        }
-        else {
-            assert(seenDouble);
-            return '\'';
-        }
-    }
-
-    inline void Writer::printQuoted(const std::string& value) {
-        static const char HEX[] = "0123456789abcdef";
-        char quoteChar = decideQuoteChar(value);
-        _stream << quoteChar;
-        for (unsigned char c : value) {
-            if (c == quoteChar) {
-                _stream.put('\\');
-                _stream.put(quoteChar);
-            } else if (c == '\\') {
-                _stream.put('\\');
-                _stream.put('\\');
-            } else if (c == '\n') {
-                _stream.put('\\');
-                _stream.put('n');
-            } else if (c == '\r') {
-                _stream.put('\\');
-                _stream.put('r');
-            } else if (c == '\v') {
-                _stream.put('\\');
-                _stream.put('v');
-            } else if (c == '\t') {
-                _stream.put('\\');
-                _stream.put('t');
-            } else if (c == '\b') {
-                _stream.put('\\');
-                _stream.put('b');
-            } else if (c == '\f') {
-                _stream.put('\\');
-                _stream.put('f');
-            } else if (c < 32 || c == 127) {
-                _stream.put('\\');
-                _stream.put('x');
-                _stream.put(HEX[c >> 4]);
-                _stream.put(HEX[c & 15]);
-            } else {
-                _stream.put(c);
-            }
-        }
-        _stream << quoteChar;
-    }
-
-
-    void encode(Writer& w, const Node& node) {
-        if (node.isAtom()) {
-            w = node.atom();
-        }
-        else if (node.isVector()) {
-            auto cw = w.vector();
-            for (auto& child : node) {
-                encode(cw.next(), child);
-            }
-        }
-        else if (node.isMap()) {
-            auto cw = w.map();
-            for (auto& keyChild : node.map()) {
-                if (!keyChild.second.isNull()) {
-                    encode(cw[keyChild.first], keyChild.second);
-                }
-            }
-        }
-        else {
-            assert(node.isNull());
-            w = "null";
-        }
-    }
-
-    void encode(std::ostream& s, const Node& node, uint32_t flags) {
-        Writer w(s, flags);
-        encode(w, node);
-
-        if ((flags & Flag_PRETTY_PRINT) != 0)
-        {
-            w.printNewline();
-        }
-    }
-
-    std::string encode(const Node& node, uint32_t flags) {
-        std::ostringstream oss;
-        encode(oss, node, flags);
-        return oss.str();
-    }
-}
+#include "encode.h"
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include <algorithm>
+#include <climits>
+#include <cerrno>
+#include <atomic>
+#include <thread>
+
+#if KESON_ENABLE_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+namespace keson
+{
+    template class BasicWriter<Flags_DYNAMIC>;
+    template void encode(Writer& w, const Node& node);
+
+    // Escape sequence for every byte, empty for bytes written as they are
+    struct EscapeTable {
+        char chars[256][4];
+        uint8_t lengths[256];
+
+        constexpr EscapeTable() : chars(), lengths() {
+            const char HEX[] = "0123456789abcdef";
+            for (int c = 0; c < 32; c++) {
+                set(c, 'x', HEX[c >> 4], HEX[c & 15]);
+            }
+            set(127, 'x', HEX[127 >> 4], HEX[127 & 15]);
+            set('\n', 'n');
+            set('\r', 'r');
+            set('\v', 'v');
+            set('\t', 't');
+            set('\b', 'b');
+            set('\f', 'f');
+            set('\\', '\\');
+        }
+
+        constexpr void set(int c, char a, char b = 0, char d = 0) {
+            chars[c][0] = '\\';
+            chars[c][1] = a;
+            chars[c][2] = b;
+            chars[c][3] = d;
+            lengths[c] = b == 0 ? 2 : 4;
+        }
+    };
+
+    static constexpr EscapeTable ESCAPES;
+
+    // Classes of every byte. NUL counts as an extended safe char, since it always has.
+    struct ClassTable {
+        uint8_t classes[256];
+
+        constexpr ClassTable() : classes() {
+            const char EXTENDED_SAFE_CHARS[] = "-+=.@$/\\?!#*";
+            for (int c = 0; c < 256; c++) {
+                bool clean = ('A' <= c && c <= 'Z') || ('a' <= c && c <= 'z') || ('0' <= c && c <= '9') || c == '_';
+                bool extended = c == 0;
+                for (char e : EXTENDED_SAFE_CHARS) {
+                    extended |= (c == e);
+                }
+                classes[c] = (clean ? 0 : Class_NOT_CLEAN) | (clean || extended ? 0 : Class_NOT_EXTENDED_CLEAN);
+            }
+            classes[(int)'\''] |= Class_SINGLE_QUOTE;
+            classes[(int)'"'] |= Class_DOUBLE_QUOTE;
+            for (int c = 0; c < 256; c++) {
+                if (ESCAPES.lengths[c] != 0) {
+                    classes[c] |= Class_ESCAPE;
+                }
+            }
+        }
+    };
+
+    static constexpr ClassTable CLASSES;
+
+    uint32_t classifyString(const char* data, size_t size) {
+        uint32_t classes = 0;
+        bool slash = false;
+        for (size_t i = 0; i < size; i++) {
+            unsigned char c = data[i];
+            classes |= CLASSES.classes[c];
+            slash |= (c == '/');
+        }
+
+        if (slash) {
+            for (size_t i = 0; i + 1 < size; i++) {
+                if (data[i] == '/' && (data[i + 1] == '/' || data[i + 1] == '*')) {
+                    classes |= Class_COMMENT_START;
+                    break;
+                }
+            }
+        }
+        return classes;
+    }
+
+#if KESON_ENABLE_SSE2
+    static int countTrailingZeros(uint32_t mask) {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward(&index, mask);
+        return (int)index;
+#else
+        return __builtin_ctz(mask);
+#endif
+    }
+#endif
+
+    size_t findEscape(const char* data, size_t size, char quoteChar) {
+        size_t i = 0;
+#if KESON_ENABLE_SSE2
+        const __m128i quote = _mm_set1_epi8(quoteChar);
+        const __m128i backslash = _mm_set1_epi8('\\');
+        const __m128i del = _mm_set1_epi8(127);
+        const __m128i lastControl = _mm_set1_epi8(31);
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 16 <= size; i += 16) {
+            __m128i bytes = _mm_loadu_si128((const __m128i*)(data + i));
+            // Saturating subtraction leaves zero exactly for the control characters
+            __m128i control = _mm_cmpeq_epi8(_mm_subs_epu8(bytes, lastControl), zero);
+            __m128i hits = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(bytes, quote), _mm_cmpeq_epi8(bytes, backslash)),
+                _mm_or_si128(_mm_cmpeq_epi8(bytes, del), control));
+            uint32_t mask = (uint32_t)_mm_movemask_epi8(hits);
+            if (mask != 0) {
+                return i + countTrailingZeros(mask);
+            }
+        }
+#endif
+        for (; i < size; i++) {
+            if (data[i] == quoteChar || ESCAPES.lengths[(unsigned char)data[i]] != 0) {
+                return i;
+            }
+        }
+        return size;
+    }
+
+    size_t writeEscape(unsigned char c, char* out) {
+        size_t length = ESCAPES.lengths[c];
+        assert(length != 0);
+        memcpy(out, ESCAPES.chars[c], length);
+        return length;
+    }
+
+    void StreamSink::write(const char* data, size_t size) {
+        _stream.write(data, size);
+    }
+
+    void StringSink::write(const char* data, size_t size) {
+        _string.append(data, size);
+    }
+
+    void FileSink::write(const char* data, size_t size) {
+        fwrite(data, 1, size, _file);
+    }
+
+    void FdSink::write(const char* data, size_t size) {
+        while (size > 0 && !_failed) {
+#ifdef _WIN32
+            int written = ::_write(_fd, data, (unsigned)std::min<size_t>(size, INT_MAX));
+#else
+            ssize_t written = ::write(_fd, data, size);
+#endif
+            if (written < 0) {
+                _failed = (errno != EINTR);
+                continue;
+            }
+            data += written;
+            size -= written;
+        }
+    }
+
+    static bool isFragmentWhitespace(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    }
+
+    // Characters that end an unquoted atom, as in the decoder
+    static bool isNakedDelimiter(char c) {
+        return isFragmentWhitespace(c) || c == ':' || c == '=' || c == '[' || c == ']' || c == '{' || c == '}'
+            || c == '"' || c == '\'' || c == '/' || c == ',';
+    }
+
+    bool isValidFragment(std::string_view fragment) {
+        // One entry per open bracket, innermost last: ']' inside a vector, and inside
+        // a map '}' before a key, ':' before the separator and '=' before the value
+        std::string open;
+        bool complete = false;
+
+        // Called where a value starts, or a key when atom is set. Returns whether one
+        // may start there.
+        auto startValue = [&](bool atom) {
+            if (open.empty()) {
+                return true;
+            }
+            char& state = open.back();
+            if (state == '}' && atom) {
+                state = ':';
+                return true;
+            }
+            if (state == '=') {
+                state = '}';
+                return true;
+            }
+            return state == ']';
+        };
+
+        size_t i = 0;
+        size_t size = fragment.size();
+        while (i < size) {
+            char c = fragment[i];
+            if (isFragmentWhitespace(c)) {
+                i++;
+                continue;
+            }
+
+            if (c == '/') {
+                if (i + 1 < size && fragment[i + 1] == '/') {
+                    while (i < size && fragment[i] != '\n') {
+                        i++;
+                    }
+                    // Whatever is written after the fragment would be commented out
+                    if (i >= size) {
+                        return false;
+                    }
+                    continue;
+                }
+                if (i + 1 >= size || fragment[i + 1] != '*') {
+                    return false;
+                }
+                int depth = 1;
+                i += 2;
+                while (depth > 0) {
+                    if (i + 1 >= size) {
+                        return false;
+                    }
+                    if (fragment[i] == '*' && fragment[i + 1] == '/') {
+                        depth--;
+                        i += 2;
+                    } else if (fragment[i] == '/' && fragment[i + 1] == '*') {
+                        depth++;
+                        i += 2;
+                    } else {
+                        i++;
+                    }
+                }
+                continue;
+            }
+
+            // Anything but a comment after the value is a second value
+            if (complete) {
+                return false;
+            }
+
+            switch (c) {
+            case '{':
+            case '[':
+                if (!startValue(false)) {
+                    return false;
+                }
+                open += c == '{' ? '}' : ']';
+                i++;
+                break;
+            case '}':
+            case ']':
+                if (open.empty() || open.back() != c) {
+                    return false;
+                }
+                open.pop_back();
+                i++;
+                break;
+            case ',':
+                if (open.empty() || (open.back() != '}' && open.back() != ']')) {
+                    return false;
+                }
+                i++;
+                break;
+            case ':':
+            case '=':
+                if (open.empty() || open.back() != ':') {
+                    return false;
+                }
+                open.back() = '=';
+                i++;
+                break;
+            case '"':
+            case '\'':
+                if (!startValue(true)) {
+                    return false;
+                }
+                for (i++; i < size && fragment[i] != c; i++) {
+                    if (fragment[i] == '\\') {
+                        i++;
+                    }
+                }
+                if (i >= size) {
+                    return false;
+                }
+                i++;
+                break;
+            default:
+                if (!startValue(true)) {
+                    return false;
+                }
+                while (i < size && !isNakedDelimiter(fragment[i])) {
+                    i++;
+                }
+                break;
+            }
+            complete = open.empty();
+        }
+        return complete;
+    }
+
+    // Keeps nothing, for measuring
+    class DiscardSink : public Sink {
+    public:
+        void write(const char*, size_t) override {}
+    };
+
+    void encode(std::ostream& s, const Node& node, uint32_t flags) {
+        Writer w(s, flags);
+        encodeDocument(w, node);
+    }
+
+    std::string encode(const Node& node, uint32_t flags) {
+        std::string result;
+        StringSink sink(result);
+        {
+            Writer w(sink, flags);
+            encodeDocument(w, node);
+        }
+        return result;
+    }
+
+    size_t encodedSize(const Node& node, uint32_t flags) {
+        DiscardSink sink;
+        Writer w(sink, flags);
+        encodeDocument(w, node);
+        return w.size();
+    }
+
+    size_t encodeTo(char* buffer, size_t capacity, const Node& node, uint32_t flags) {
+        Writer w(buffer, capacity, flags);
+        encodeDocument(w, node);
+        return w.size();
+    }
+
+    void encodeTo(std::string& out, const Node& node, uint32_t flags) {
+        out.resize(out.capacity());
+        size_t size = encodeTo(&out[0], out.size(), node, flags);
+        if (size > out.size()) {
+            out.resize(size);
+            encodeTo(&out[0], size, node, flags);
+        }
+        out.resize(size);
+    }
+
+    ThreadTaskPool::ThreadTaskPool(size_t threadCount)
+        : _threadCount(threadCount != 0 ? threadCount : std::max<size_t>(1, std::thread::hardware_concurrency()))
+    {
+    }
+
+    void ThreadTaskPool::run(size_t count, const std::function<void(size_t)>& task) {
+        std::atomic<size_t> next { 0 };
+        auto work = [&]() {
+            for (size_t i = next++; i < count; i = next++) {
+                task(i);
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < std::min(_threadCount, count); i++) {
+            threads.emplace_back(work);
+        }
+        work();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    // Smallest number of elements worth handing to another thread as one chunk
+    static const size_t PARALLEL_MIN_CHUNK = 256;
+    // Containers with fewer elements than this are not split, as they would not
+    // make at least two chunks
+    static const size_t PARALLEL_MIN_ELEMENTS = 2 * PARALLEL_MIN_CHUNK;
+
+    // Walks the document like encode, writing everything but the elements of large
+    // containers. Those are left as chunks, which note where in the output they
+    // belong and start out as if the writer had just written the element before them.
+    class ParallelEncoder {
+    public:
+        ParallelEncoder(uint32_t flags, TaskPool& pool) : _flags(flags), _pool(pool) {}
+
+        std::string encode(const Node& node) {
+            std::string outline;
+            {
+                StringSink sink(outline);
+                Writer w(sink, _flags);
+                encodeOutline(w, node);
+                if ((_flags & Flag_PRETTY_PRINT) != 0) {
+                    w.printNewline();
+                }
+            }
+
+            _pool.run(_chunks.size(), [&](size_t i) { encodeChunk(_chunks[i]); });
+
+            size_t total = outline.size();
+            for (auto& chunk : _chunks) {
+                total += chunk.output.size();
+            }
+
+            std::string result;
+            result.reserve(total);
+            size_t pos = 0;
+            for (auto& chunk : _chunks) {
+                result.append(outline, pos, chunk.offset - pos);
+                result += chunk.output;
+                pos = chunk.offset;
+            }
+            result.append(outline, pos, std::string::npos);
+            return result;
+        }
+
+    private:
+        struct Chunk {
+            const Node* container;
+            size_t begin;
+            size_t end;
+            uint32_t depth;
+            bool first;
+            size_t offset;
+            std::string output;
+        };
+
+        void encodeOutline(Writer& w, const Node& node) {
+            size_t count = node.isVector() ? node.vector().size() : node.isMap() ? node.map().size() : 0;
+            if (count < PARALLEL_MIN_ELEMENTS) {
+                if (node.isVector()) {
+                    auto cw = w.vector();
+                    for (auto& child : node) {
+                        encodeOutline(cw.next(), child);
+                    }
+                }
+                else if (node.isMap()) {
+                    auto cw = w.map();
+                    for (auto& keyChild : node.map()) {
+                        if (!keyChild.second.isNull()) {
+                            encodeOutline(cw[keyChild.first], keyChild.second);
+                        }
+                    }
+                }
+                else {
+                    keson::encode(w, node);
+                }
+                return;
+            }
+
+            // Same output as the container writers, with the elements left to chunks
+            w.put(node.isVector() ? '[' : '{');
+            size_t chunkCount = std::clamp<size_t>(_pool.concurrency() * 4, 1, count / PARALLEL_MIN_CHUNK);
+            bool first = true;
+            for (size_t c = 0; c < chunkCount; c++) {
+                size_t begin = count * c / chunkCount;
+                size_t end = count * (c + 1) / chunkCount;
+                _chunks.push_back({ &node, begin, end, w._depth + 1, first, w.size(), std::string() });
+                first = first && !hasElements(node, begin, end);
+            }
+            if (!first) {
+                w.printNewline();
+            }
+            w.put(node.isVector() ? ']' : '}');
+            w.endValue();
+        }
+
+        // Null map entries are left out, so a map chunk may produce nothing
+        static bool hasElements(const Node& node, size_t begin, size_t end) {
+            if (node.isVector()) {
+                return begin < end;
+            }
+            auto it = node.map().begin();
+            return std::any_of(it + begin, it + end, [](auto& keyChild) { return !keyChild.second.isNull(); });
+        }
+
+        void encodeChunk(Chunk& chunk) {
+            StringSink sink(chunk.output);
+            Writer w(sink, _flags);
+            w._depth = chunk.depth;
+            bool first = chunk.first;
+            for (size_t i = chunk.begin; i < chunk.end; i++) {
+                const Node* child;
+                if (chunk.container->isVector()) {
+                    child = &chunk.container->vector()[i];
+                }
+                else {
+                    auto& keyChild = *(chunk.container->map().begin() + i);
+                    if (keyChild.second.isNull()) {
+                        continue;
+                    }
+                    child = &keyChild.second;
+                }
+
+                if (!first) {
+                    w.put(',');
+                }
+                first = false;
+                w.printNewline();
+                if (chunk.container->isMap()) {
+                    w.printKey((chunk.container->map().begin() + i)->first);
+                }
+                keson::encode(w, *child);
+            }
+        }
+
+        uint32_t _flags;
+        TaskPool& _pool;
+        std::vector<Chunk> _chunks;
+    };
+
+    std::string encodeParallel(const Node& node, uint32_t flags, TaskPool* pool) {
+        if (pool == nullptr) {
+            ThreadTaskPool threads;
+            return ParallelEncoder(flags, threads).encode(node);
+        }
+        return ParallelEncoder(flags, *pool).encode(node);
+    }
+}
@@ -1,122 +1,1019 @@
-#pragma once
-
-#include <cstdint>
-#include <string>
-#include <ostream>
-
-#include "conf.h"
-
-namespace keson
-{
-    static const uint32_t Flag_PRETTY_PRINT         = (1 << 0);
-    static const uint32_t Flag_QUOTE_KEYS           = (1 << 1);
-    static const uint32_t Flag_QUOTE_STRING_VALUES  = (1 << 2);
-    static const uint32_t Flag_QUOTE_NUMERIC_VALUES = (1 << 3);
-    static const uint32_t Flag_QUOTE_BOOLEAN_VALUES = (1 << 4);
-    static const uint32_t Flag_PREFER_SINGLE_QUOTES = (1 << 5);
-    static const uint32_t Flag_FLEXIBLE_QUOTES      = (1 << 6);
-    static const uint32_t Flag_EXTENDED_SAFE_CHARS  = (1 << 7);
-    static const uint32_t Flag_CRLF_NEWLINES        = (1 << 8);
-    static const uint32_t Flag_INDENT_WITH_SPACES   = (1 << 9);
-
-    static const uint32_t Flags_JSON_STYLE_QUOTES   = Flag_QUOTE_KEYS | Flag_QUOTE_STRING_VALUES;
-    static const uint32_t Flags_PTREE_STYLE_QUOTES  = Flag_QUOTE_KEYS | Flag_QUOTE_STRING_VALUES | Flag_QUOTE_NUMERIC_VALUES | Flag_QUOTE_BOOLEAN_VALUES;
-    static const uint32_t Flags_RELAXED_QUOTES      = Flag_FLEXIBLE_QUOTES | Flag_EXTENDED_SAFE_CHARS;
-
-    class Writer;
-    class Node;
-
-    class MapWriter {
-    public:
-        ~MapWriter();
-
-        Writer& operator[](const std::string& key);
-
-    private:
-        friend class Writer;
-
-        MapWriter(Writer* parent);
-
-        Writer* _parent;
-        bool _first = true;
-    };
-
-    class VectorWriter {
-    public:
-        ~VectorWriter();
-
-        Writer& next();
-        
-    private:
-        friend class Writer;
-
-        VectorWriter(Writer* parent);
-
-        Writer* _parent;
-        bool _first = true;
-    };
-
-    class Writer {
-    public:
-        Writer(std::ostream& stream, uint32_t flags = 0);
-
-        VectorWriter vector();
-
-        MapWriter map();
-
-        void operator=(const std::string&  value);
-        void operator=(int8_t              value);
-        void operator=(uint8_t             value);
-        void operator=(int16_t             value);
-        void operator=(uint16_t            value);
-        void operator=(int32_t             value);
-        void operator=(uint32_t            value);
-        void operator=(int64_t             value);
-        void operator=(uint64_t            value);
-        void operator=(float               value);
-        void operator=(double              value);
-        void operator=(bool                value);
-#if KESON_ENABLE_WSTRING
-        void operator=(const std::wstring& value);
-#endif
-
-        void printNewline();
-
-        void printComment(const std::string& value);
-#if KESON_ENABLE_WSTRING
-        void printComment(const std::wstring& value);
-#endif
-
-    private:
-        friend class MapWriter;
-        friend class VectorWriter;
-
-        void printKey(const std::string& value);
-        
-        void printString(const std::string& value);
-        
-        void printNumeric(const std::string& value);
-        
-        void printBoolean(const std::string& value);
-
-        bool isClean(const std::string& value);
-        
-        void printCleanIfPossible(const std::string& value);
-
-        void printClean(const std::string& value);
-        
-        char decideQuoteChar(const std::string& value);
-
-        void printQuoted(const std::string& value);
-
-        std::ostream& _stream;
-        uint32_t _flags;
-        uint32_t _depth;
-    };
-
-    void encode(Writer& w, const Node& node);
-
-    void encode(std::ostream& s, const Node& node, uint32_t flags = 0);
-
-    std::string encode(const Node& node, uint32_t flags = 0);
-}
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+#include <string>
+#include <string_view>
+#include <ostream>
+#include <variant>
+#include <memory>
+#include <optional>
+#include <cstdio>
+#include <charconv>
+#include <algorithm>
+#include <type_traits>
+#include <functional>
+
+#include "conf.h"
+#include "node.h"
+#include "util.h"
+
+namespace keson
+{
+    static const uint32_t Flag_PRETTY_PRINT         = (1 << 0);
+    static const uint32_t Flag_QUOTE_KEYS           = (1 << 1);
+    static const uint32_t Flag_QUOTE_STRING_VALUES  = (1 << 2);
+    static const uint32_t Flag_QUOTE_NUMERIC_VALUES = (1 << 3);
+    static const uint32_t Flag_QUOTE_BOOLEAN_VALUES = (1 << 4);
+    static const uint32_t Flag_PREFER_SINGLE_QUOTES = (1 << 5);
+    static const uint32_t Flag_FLEXIBLE_QUOTES      = (1 << 6);
+    static const uint32_t Flag_EXTENDED_SAFE_CHARS  = (1 << 7);
+    static const uint32_t Flag_CRLF_NEWLINES        = (1 << 8);
+    static const uint32_t Flag_INDENT_WITH_SPACES   = (1 << 9);
+
+    static const uint32_t Flags_JSON_STYLE_QUOTES   = Flag_QUOTE_KEYS | Flag_QUOTE_STRING_VALUES;
+    static const uint32_t Flags_PTREE_STYLE_QUOTES  = Flag_QUOTE_KEYS | Flag_QUOTE_STRING_VALUES | Flag_QUOTE_NUMERIC_VALUES | Flag_QUOTE_BOOLEAN_VALUES;
+    static const uint32_t Flags_RELAXED_QUOTES      = Flag_FLEXIBLE_QUOTES | Flag_EXTENDED_SAFE_CHARS;
+
+    // Passed as the Flags of BasicWriter to take the flags from the constructor at
+    // runtime instead, which is what Writer does.
+    static const uint32_t Flags_DYNAMIC             = 0xffffffff;
+
+    // Receives the output of a Writer, which collects it into large blocks first.
+    class Sink {
+    public:
+        virtual ~Sink() {}
+
+        virtual void write(const char* data, size_t size) = 0;
+    };
+
+    class StreamSink : public Sink {
+    public:
+        StreamSink(std::ostream& stream) : _stream(stream) {}
+
+        void write(const char* data, size_t size) override;
+
+    private:
+        std::ostream& _stream;
+    };
+
+    // Appends to the string
+    class StringSink : public Sink {
+    public:
+        StringSink(std::string& string) : _string(string) {}
+
+        void write(const char* data, size_t size) override;
+
+    private:
+        std::string& _string;
+    };
+
+    // Errors are left for ferror to report
+    class FileSink : public Sink {
+    public:
+        FileSink(FILE* file) : _file(file) {}
+
+        void write(const char* data, size_t size) override;
+
+    private:
+        FILE* _file;
+    };
+
+    // Writes to a file descriptor, retrying partial and interrupted writes. Once a
+    // write fails the rest of the output is dropped.
+    class FdSink : public Sink {
+    public:
+        FdSink(int fd) : _fd(fd) {}
+
+        void write(const char* data, size_t size) override;
+
+        bool failed() const { return _failed; }
+
+    private:
+        int _fd;
+        bool _failed = false;
+    };
+
+    // Kinds of bytes a string contains, as found by classifyString
+    static const uint32_t Class_NOT_CLEAN           = (1 << 0); // Outside A-Z, a-z, 0-9 and _
+    static const uint32_t Class_NOT_EXTENDED_CLEAN  = (1 << 1); // Also outside the extended safe chars
+    static const uint32_t Class_COMMENT_START       = (1 << 2); // Contains // or /*
+    static const uint32_t Class_SINGLE_QUOTE        = (1 << 3);
+    static const uint32_t Class_DOUBLE_QUOTE        = (1 << 4);
+    static const uint32_t Class_ESCAPE              = (1 << 5); // Backslash, control character or DEL
+
+    // One table driven pass that answers everything the writer needs to know about a
+    // string: whether it can be written without quotes, which quotes it contains and
+    // whether it needs escapes.
+    uint32_t classifyString(const char* data, size_t size);
+
+    // Returns the index of the first byte in data that printQuoted has to escape: the
+    // quote character, a backslash, a control character or DEL. Returns size if there
+    // is none.
+    size_t findEscape(const char* data, size_t size, char quoteChar);
+
+    // Writes the escape sequence for a backslash, control character or DEL to out and
+    // returns its length, which is at most four.
+    size_t writeEscape(unsigned char c, char* out);
+
+    // Options for Writer::raw
+    static const uint32_t Raw_VALIDATE = (1 << 0); // Check the fragment with isValidFragment first
+    static const uint32_t Raw_REINDENT = (1 << 1); // Indent its lines to the depth it is written at
+
+    // Quick structural check that fragment holds exactly one value: brackets and
+    // braces are balanced and matched, map entries are a key, ':' or '=' and a value,
+    // vectors hold no separators, quotes and comments are closed, and nothing but
+    // whitespace and comments follows the value. A line comment must end in a newline
+    // so that it cannot swallow what is written after the fragment. It does not check
+    // that escape sequences are valid.
+    bool isValidFragment(std::string_view fragment);
+
+    template<uint32_t Flags> class BasicWriter;
+    class ParallelEncoder;
+
+    template<uint32_t Flags>
+    class BasicMapWriter {
+    public:
+        ~BasicMapWriter();
+
+        BasicWriter<Flags>& operator[](std::string_view key);
+
+    private:
+        friend class BasicWriter<Flags>;
+
+        BasicMapWriter(BasicWriter<Flags>* parent);
+
+        BasicWriter<Flags>* _parent;
+        bool _first = true;
+    };
+
+    template<uint32_t Flags>
+    class BasicVectorWriter {
+    public:
+        ~BasicVectorWriter();
+
+        BasicWriter<Flags>& next();
+        
+    private:
+        friend class BasicWriter<Flags>;
+
+        BasicVectorWriter(BasicWriter<Flags>* parent);
+
+        BasicWriter<Flags>* _parent;
+        bool _first = true;
+    };
+
+    // With Flags known at compile time every flag check below is a constant, so each
+    // combination of flags gets its own code without the branches for the others.
+    // Writer takes the flags at runtime instead and writes the same bytes.
+    //
+    // Output is collected in a buffer of bufferSize bytes and passed on to the sink
+    // whenever it fills up, a top level value is complete, and on destruction. Given a
+    // buffer and no sink, the writer writes straight into that buffer instead, and
+    // anything past its capacity is dropped but still counted by size().
+    template<uint32_t Flags>
+    class BasicWriter {
+    public:
+        static constexpr size_t DEFAULT_BUFFER_SIZE = 16 * 1024;
+
+        BasicWriter(std::ostream& stream, uint32_t flags = Flags == Flags_DYNAMIC ? 0 : Flags, size_t bufferSize = DEFAULT_BUFFER_SIZE);
+
+        BasicWriter(Sink& sink, uint32_t flags = Flags == Flags_DYNAMIC ? 0 : Flags, size_t bufferSize = DEFAULT_BUFFER_SIZE);
+
+        BasicWriter(char* buffer, size_t capacity, uint32_t flags = Flags == Flags_DYNAMIC ? 0 : Flags);
+
+        BasicWriter(const BasicWriter&) = delete;
+
+        ~BasicWriter();
+
+        BasicVectorWriter<Flags> vector();
+
+        BasicMapWriter<Flags> map();
+
+        void operator=(std::string_view    value);
+        void operator=(const char*         value);
+        void operator=(int8_t              value);
+        void operator=(uint8_t             value);
+        void operator=(int16_t             value);
+        void operator=(uint16_t            value);
+        void operator=(int32_t             value);
+        void operator=(uint32_t            value);
+        void operator=(int64_t             value);
+        void operator=(uint64_t            value);
+        void operator=(float               value);
+        void operator=(double              value);
+        void operator=(bool                value);
+#if KESON_ENABLE_WSTRING
+        void operator=(const std::wstring& value);
+#endif
+
+        // Writes a vector of numbers, the same as assigning each to vector().next(),
+        // but formats runs of them straight into the buffer with one room check.
+        template<typename T>
+        void writeArray(const T* values, size_t count);
+
+        // Writes an already encoded value as it is, in place of assigning one. Returns
+        // false without writing anything if Raw_VALIDATE is given and the fragment is
+        // not valid. With Raw_REINDENT and Flag_PRETTY_PRINT, every line after the
+        // first is indented to the current depth, which suits fragments pretty printed
+        // on their own, and a trailing newline is dropped unless it ends a comment.
+        bool raw(std::string_view fragment, uint32_t options = 0);
+
+        void printNewline();
+
+        void printComment(std::string_view value);
+#if KESON_ENABLE_WSTRING
+        void printComment(const std::wstring& value);
+#endif
+
+        void flush();
+
+        // Number of bytes produced so far, including those dropped for lack of room
+        size_t size() const;
+
+        uint32_t flags() const;
+
+    private:
+        friend class BasicMapWriter<Flags>;
+        friend class BasicVectorWriter<Flags>;
+        friend class ParallelEncoder;
+
+        template<uint32_t F>
+        friend void encode(BasicWriter<F>& w, const Node& node);
+
+        // Longest output of to_chars for any numeric type, -2.2250738585072014e-308
+        static constexpr size_t MAX_NUMBER_LENGTH = 32;
+
+        bool has(uint32_t flag) const;
+
+        void put(char c);
+
+        void append(const char* data, size_t size);
+
+        // Handles data that does not fit in the rest of the buffer
+        void overflow(const char* data, size_t size);
+
+        // Flushes once a value at the top level is complete
+        void endValue();
+
+        // Extends _indent to cover a newline at the given length
+        void growIndent(size_t length);
+
+        // Writes fragment with the current indentation after each line break outside
+        // of quotes
+        void printReindented(std::string_view fragment);
+
+#if KESON_ENABLE_ENCODE_CACHE
+        // Writes the cached encoding of node if it matches the flags and depth
+        bool printCached(const Node& node);
+
+        // Keeps a copy of everything written from the returned position on, until the
+        // matching endRecording stores it as the cached encoding of node. Recordings
+        // nest, sharing one copy of the output.
+        size_t beginRecording();
+
+        void endRecording(size_t start, const Node& node);
+#endif
+
+        void printKey(std::string_view value);
+        
+        void printString(std::string_view value);
+        
+        template<typename T>
+        void printNumeric(T value);
+        
+        void printBoolean(bool value);
+
+        bool isClean(std::string_view value, uint32_t classes);
+        
+        void printCleanIfPossible(std::string_view value);
+
+        void printClean(std::string_view value);
+        
+        char decideQuoteChar(uint32_t classes);
+
+        void printQuoted(std::string_view value);
+
+        void printQuoted(std::string_view value, uint32_t classes);
+
+        std::optional<StreamSink> _streamSink;
+        Sink* _sink;
+        std::unique_ptr<char[]> _buffer;
+        char* _begin;
+        char* _pos;
+        char* _end;
+        size_t _flushed = 0;
+        size_t _dropped = 0;
+        uint32_t _flags;
+        uint32_t _depth;
+
+        // A newline followed by the indentation of the deepest level printed so far.
+        // The newline for depth d is its prefix.
+        std::string _indent;
+
+#if KESON_ENABLE_ENCODE_CACHE
+        // Output flushed since the outermost recording began at _recordingStart
+        std::string _recording;
+        size_t _recordingStart = 0;
+        uint32_t _recordingDepth = 0;
+#endif
+    };
+
+    using Writer       = BasicWriter<Flags_DYNAMIC>;
+    using MapWriter    = BasicMapWriter<Flags_DYNAMIC>;
+    using VectorWriter = BasicVectorWriter<Flags_DYNAMIC>;
+
+    template<uint32_t Flags>
+    void encode(BasicWriter<Flags>& w, const Node& node);
+
+    // Encodes node as a whole document, which ends with a newline when pretty printing
+    template<uint32_t Flags>
+    void encodeDocument(BasicWriter<Flags>& w, const Node& node);
+
+    void encode(std::ostream& s, const Node& node, uint32_t flags = 0);
+
+    std::string encode(const Node& node, uint32_t flags = 0);
+
+    // Exact length of what encode would produce. Measuring formats the whole document
+    // without keeping it, so it is about as costly as encoding.
+    size_t encodedSize(const Node& node, uint32_t flags = 0);
+
+    // Encodes straight into buffer, for example a memory mapped file sized with
+    // encodedSize. Returns the full encoded length. If that is more than capacity,
+    // only the first capacity bytes were written.
+    size_t encodeTo(char* buffer, size_t capacity, const Node& node, uint32_t flags = 0);
+
+    // Replaces the contents of out. The first attempt writes into the capacity out
+    // already has, so reusing the same string for similar documents encodes them in
+    // place in a single pass. If that capacity is too small, out is resized to the
+    // exact length and encoded again.
+    void encodeTo(std::string& out, const Node& node, uint32_t flags = 0);
+
+    // Runs the independent tasks of encodeParallel
+    class TaskPool {
+    public:
+        virtual ~TaskPool() {}
+
+        // Calls task(i) for every i below count, possibly concurrently, and returns
+        // once all of them have finished.
+        virtual void run(size_t count, const std::function<void(size_t)>& task) = 0;
+
+        // Number of tasks worth running at once
+        virtual size_t concurrency() const = 0;
+    };
+
+    // Starts threads for each run and joins them before returning. A threadCount of
+    // zero uses one per hardware thread.
+    class ThreadTaskPool : public TaskPool {
+    public:
+        explicit ThreadTaskPool(size_t threadCount = 0);
+
+        void run(size_t count, const std::function<void(size_t)>& task) override;
+
+        size_t concurrency() const override { return _threadCount; }
+
+    private:
+        size_t _threadCount;
+    };
+
+    // Produces the same output as encode, but splits vectors and maps with many
+    // elements into chunks that are encoded on the pool at their own depth and then
+    // joined in order. Elements of a chunk are encoded sequentially, as is everything
+    // outside the large containers. Without a pool a ThreadTaskPool is used.
+    std::string encodeParallel(const Node& node, uint32_t flags = 0, TaskPool* pool = nullptr);
+
+    // Encodes with the flags fixed at compile time
+    template<uint32_t Flags>
+    void encode(std::ostream& s, const Node& node);
+
+    template<uint32_t Flags>
+    std::string encode(const Node& node);
+
+    ////////////////////
+    // Implementation //
+    ////////////////////
+
+    template<uint32_t Flags>
+    inline BasicMapWriter<Flags>::~BasicMapWriter() {
+        _parent->_depth -= 1;
+        if (!_first) {
+            _parent->printNewline();
+        }
+        _parent->put('}');
+        _parent->endValue();
+    }
+
+    template<uint32_t Flags>
+    inline BasicWriter<Flags>& BasicMapWriter<Flags>::operator[](std::string_view key) {
+        if (!_first) {
+            _parent->put(',');
+        }
+        _first = false;
+        _parent->printNewline();
+        _parent->printKey(key);
+        return *_parent;
+    }
+
+    template<uint32_t Flags>
+    inline BasicMapWriter<Flags>::BasicMapWriter(BasicWriter<Flags>* parent) : _parent(parent) {
+        _parent->put('{');
+        _parent->_depth += 1;
+    }
+
+    template<uint32_t Flags>
+    inline BasicVectorWriter<Flags>::~BasicVectorWriter() {
+        _parent->_depth -= 1;
+        if (!_first) {
+            _parent->printNewline();
+        }
+        _parent->put(']');
+        _parent->endValue();
+    }
+
+    template<uint32_t Flags>
+    inline BasicWriter<Flags>& BasicVectorWriter<Flags>::next() {
+        if (!_first) {
+            _parent->put(',');
+        }
+        _first = false;
+        _parent->printNewline();
+        return *_parent;
+    }
+
+    template<uint32_t Flags>
+    inline BasicVectorWriter<Flags>::BasicVectorWriter(BasicWriter<Flags>* parent) : _parent(parent) {
+        _parent->put('[');
+        _parent->_depth += 1;
+    }
+
+    template<uint32_t Flags>
+    inline BasicWriter<Flags>::BasicWriter(std::ostream& stream, uint32_t flags, size_t bufferSize)
+        : _streamSink(std::in_place, stream)
+        , _sink(&*_streamSink)
+        , _buffer(new char[bufferSize])
+        , _begin(_buffer.get())
+        , _pos(_begin)
+        , _end(_begin + bufferSize)
+        , _flags(flags)
+        , _depth(0)
+    {
+        assert(Flags == Flags_DYNAMIC || flags == Flags);
+        assert(bufferSize > 0);
+    }
+
+    template<uint32_t Flags>
+    inline BasicWriter<Flags>::BasicWriter(Sink& sink, uint32_t flags, size_t bufferSize)
+        : _sink(&sink)
+        , _buffer(new char[bufferSize])
+        , _begin(_buffer.get())
+        , _pos(_begin)
+        , _end(_begin + bufferSize)
+        , _flags(flags)
+        , _depth(0)
+    {
+        assert(Flags == Flags_DYNAMIC || flags == Flags);
+        assert(bufferSize > 0);
+    }
+
+    template<uint32_t Flags>
+    inline BasicWriter<Flags>::BasicWriter(char* buffer, size_t capacity, uint32_t flags)
+        : _sink(nullptr)
+        , _begin(buffer)
+        , _pos(buffer)
+        , _end(buffer + capacity)
+        , _flags(flags)
+        , _depth(0)
+    {
+        assert(Flags == Flags_DYNAMIC || flags == Flags);
+    }
+
+    template<uint32_t Flags>
+    inline BasicWriter<Flags>::~BasicWriter() {
+        flush();
+    }
+
+    template<uint32_t Flags>
+    inline BasicVectorWriter<Flags> BasicWriter<Flags>::vector() {
+        return BasicVectorWriter<Flags>(this);
+    }
+
+    template<uint32_t Flags>
+    inline BasicMapWriter<Flags> BasicWriter<Flags>::map() {
+        return BasicMapWriter<Flags>(this);
+    }
+
+    template<uint32_t Flags> void BasicWriter<Flags>::operator=(std::string_view value)    { printString(value); endValue(); }
+    template<uint32_t Flags> void BasicWriter<Flags>::operator=(const char* value)         { printString(value); endValue(); }
+    template<uint32_t Flags> void BasicWriter<Flags>::operator=(int8_t value)              { printNumeric(value); endValue(); }
+    template<uint32_t Flags> void BasicWriter<Flags>::operator=(uint8_t value)             { printNumeric(value); endValue(); }
+    template<uint32_t Flags> void BasicWriter<Flags>::operator=(int16_t value)             { printNumeric(value); endValue(); }
+    template<uint32_t Flags> void BasicWriter<Flags>::operator=(uint16_t value)            { printNumeric(value); endValue(); }
+    template<uint32_t Flags> void BasicWriter<Flags>::operator=(int32_t value)             { printNumeric(value); endValue(); }
+    template<uint32_t Flags> void BasicWriter<Flags>::operator=(uint32_t value)            { printNumeric(value); endValue(); }
+    template<uint32_t Flags> void BasicWriter<Flags>::operator=(int64_t value)             { printNumeric(value); endValue(); }
+    template<uint32_t Flags> void BasicWriter<Flags>::operator=(uint64_t value)            { printNumeric(value); endValue(); }
+    template<uint32_t Flags> void BasicWriter<Flags>::operator=(float value)               { printNumeric(value); endValue(); }
+    template<uint32_t Flags> void BasicWriter<Flags>::operator=(double value)              { printNumeric(value); endValue(); }
+    template<uint32_t Flags> void BasicWriter<Flags>::operator=(bool value)                { printBoolean(value); endValue(); }
+#if KESON_ENABLE_WSTRING
+    template<uint32_t Flags> void BasicWriter<Flags>::operator=(const std::wstring& value) { printString(to_utf8(value)); endValue(); }
+#endif
+
+    template<uint32_t Flags>
+    inline bool BasicWriter<Flags>::has(uint32_t flag) const {
+        if constexpr (Flags == Flags_DYNAMIC) {
+            return (_flags & flag) != 0;
+        }
+        else {
+            return (Flags & flag) != 0;
+        }
+    }
+
+    template<uint32_t Flags>
+    inline void BasicWriter<Flags>::flush() {
+        if (_sink != nullptr && _pos != _begin) {
+#if KESON_ENABLE_ENCODE_CACHE
+            if (_recordingDepth > 0) {
+                _recording.append(_begin, _pos);
+            }
+#endif
+            _sink->write(_begin, _pos - _begin);
+            _flushed += _pos - _begin;
+            _pos = _begin;
+        }
+    }
+
+    template<uint32_t Flags>
+    inline size_t BasicWriter<Flags>::size() const {
+        return _flushed + (_pos - _begin) + _dropped;
+    }
+
+    template<uint32_t Flags>
+    inline uint32_t BasicWriter<Flags>::flags() const {
+        return Flags == Flags_DYNAMIC ? _flags : Flags;
+    }
+
+    template<uint32_t Flags>
+    inline void BasicWriter<Flags>::put(char c) {
+        if (_pos == _end) {
+            overflow(&c, 1);
+            return;
+        }
+        *_pos++ = c;
+    }
+
+    template<uint32_t Flags>
+    inline void BasicWriter<Flags>::append(const char* data, size_t size) {
+        if ((size_t)(_end - _pos) < size) {
+            overflow(data, size);
+            return;
+        }
+        memcpy(_pos, data, size);
+        _pos += size;
+    }
+
+    template<uint32_t Flags>
+    void BasicWriter<Flags>::overflow(const char* data, size_t size) {
+        size_t room = _end - _pos;
+        if (_sink == nullptr) {
+            if (room > 0) {
+                memcpy(_pos, data, room);
+            }
+            _pos = _end;
+            _dropped += size - room;
+        }
+        else {
+            flush();
+            if (size <= (size_t)(_end - _begin)) {
+                memcpy(_pos, data, size);
+                _pos += size;
+            }
+            else {
+#if KESON_ENABLE_ENCODE_CACHE
+                if (_recordingDepth > 0) {
+                    _recording.append(data, size);
+                }
+#endif
+                _sink->write(data, size);
+                _flushed += size;
+            }
+        }
+    }
+
+    template<uint32_t Flags>
+    inline void BasicWriter<Flags>::endValue() {
+        if (_depth == 0) {
+            flush();
+        }
+    }
+
+    template<uint32_t Flags>
+    inline void BasicWriter<Flags>::printNewline() {
+        if (!has(Flag_PRETTY_PRINT)) { return; }
+        size_t newlineLength = has(Flag_CRLF_NEWLINES) ? 2 : 1;
+        size_t indentLength = has(Flag_INDENT_WITH_SPACES) ? 4 : 1;
+        size_t length = newlineLength + _depth * indentLength;
+        if (_indent.size() < length) {
+            growIndent(length);
+        }
+        append(_indent.data(), length);
+    }
+
+    template<uint32_t Flags>
+    void BasicWriter<Flags>::growIndent(size_t length) {
+        if (_indent.empty()) {
+            _indent = has(Flag_CRLF_NEWLINES) ? "\r\n" : "\n";
+        }
+        while (_indent.size() < length) {
+            _indent += has(Flag_INDENT_WITH_SPACES) ? "    " : "\t";
+        }
+    }
+
+    template<uint32_t Flags>
+    bool BasicWriter<Flags>::raw(std::string_view fragment, uint32_t options) {
+        if ((options & Raw_VALIDATE) != 0 && !isValidFragment(fragment)) {
+            return false;
+        }
+
+        if ((options & Raw_REINDENT) != 0 && has(Flag_PRETTY_PRINT)) {
+            printReindented(fragment);
+        } else {
+            append(fragment.data(), fragment.size());
+        }
+        endValue();
+        return true;
+    }
+
+    template<uint32_t Flags>
+    void BasicWriter<Flags>::printReindented(std::string_view fragment) {
+        std::string_view newline;
+        if (!fragment.empty() && fragment.back() == '\n') {
+            size_t length = fragment.size() > 1 && fragment[fragment.size() - 2] == '\r' ? 2 : 1;
+            newline = fragment.substr(fragment.size() - length);
+            fragment.remove_suffix(length);
+        }
+
+        size_t newlineLength = has(Flag_CRLF_NEWLINES) ? 2 : 1;
+        size_t length = newlineLength + _depth * (has(Flag_INDENT_WITH_SPACES) ? 4 : 1);
+        if (_indent.size() < length) {
+            growIndent(length);
+        }
+        const char* indent = _indent.data() + newlineLength;
+        size_t indentLength = length - newlineLength;
+
+        // Quote character of the string being skipped, or '/' inside a comment
+        char quote = 0;
+        int commentDepth = 0;
+        size_t start = 0;
+        for (size_t i = 0; i < fragment.size(); i++) {
+            char c = fragment[i];
+            char next = i + 1 < fragment.size() ? fragment[i + 1] : 0;
+            if (quote == '"' || quote == '\'') {
+                if (c == '\\') {
+                    i++;
+                } else if (c == quote) {
+                    quote = 0;
+                }
+                continue;
+            }
+
+            if (quote == '/') {
+                if (commentDepth == 0 && c == '\n') {
+                    quote = 0;
+                } else if (commentDepth > 0 && c == '*' && next == '/') {
+                    quote = --commentDepth > 0 ? '/' : 0;
+                    i++;
+                } else if (commentDepth > 0 && c == '/' && next == '*') {
+                    commentDepth++;
+                    i++;
+                }
+            } else if (c == '"' || c == '\'') {
+                quote = c;
+            } else if (c == '/' && (next == '/' || next == '*')) {
+                quote = '/';
+                commentDepth = next == '*' ? 1 : 0;
+                i++;
+            }
+
+            if (c == '\n') {
+                append(fragment.data() + start, i + 1 - start);
+                append(indent, indentLength);
+                start = i + 1;
+            }
+        }
+        append(fragment.data() + start, fragment.size() - start);
+
+        // A line comment at the end keeps its newline, or it would swallow what follows
+        if (quote == '/' && commentDepth == 0) {
+            append(newline.data(), newline.size());
+            append(indent, indentLength);
+        }
+    }
+
+    template<uint32_t Flags>
+    void BasicWriter<Flags>::printComment(std::string_view value)
+    {
+        if (!has(Flag_PRETTY_PRINT)) { return; }
+        append("/* ", 3);
+        append(value.data(), value.size());
+        append(" */", 3);
+    }
+
+#if KESON_ENABLE_WSTRING
+    template<uint32_t Flags>
+    void BasicWriter<Flags>::printComment(const std::wstring& value) { printComment(to_utf8(value)); }
+#endif
+
+    template<uint32_t Flags>
+    inline void BasicWriter<Flags>::printKey(std::string_view value) {
+        if (has(Flag_QUOTE_KEYS)) {
+            printQuoted(value);
+        } else {
+            printCleanIfPossible(value);
+        }
+
+        if (has(Flag_PRETTY_PRINT)) {
+            append(": ", 2);
+        } else {
+            put(':');
+        }
+    }
+
+    template<uint32_t Flags>
+    inline void BasicWriter<Flags>::printString(std::string_view value) {
+        if (has(Flag_QUOTE_STRING_VALUES)) {
+            printQuoted(value);
+        }
+        else {
+            printCleanIfPossible(value);
+        }
+    }
+
+    // Numbers never contain quotes or escapes, so quoting them needs no classification
+    template<uint32_t Flags>
+    template<typename T>
+    inline void BasicWriter<Flags>::printNumeric(T value) {
+        char tmp[MAX_NUMBER_LENGTH + 2];
+        bool direct = (size_t)(_end - _pos) >= sizeof(tmp);
+        char* begin = direct ? _pos : tmp;
+        char* p = begin;
+
+        char quoteChar = decideQuoteChar(0);
+        if (has(Flag_QUOTE_NUMERIC_VALUES)) { *p++ = quoteChar; }
+        p = std::to_chars(p, p + MAX_NUMBER_LENGTH, value).ptr;
+        if (has(Flag_QUOTE_NUMERIC_VALUES)) { *p++ = quoteChar; }
+
+        if (direct) {
+            _pos = p;
+        } else {
+            append(tmp, p - tmp);
+        }
+    }
+
+    template<uint32_t Flags>
+    inline void BasicWriter<Flags>::printBoolean(bool value) {
+        char quoteChar = decideQuoteChar(0);
+        if (has(Flag_QUOTE_BOOLEAN_VALUES)) { put(quoteChar); }
+        if (value) {
+            append("true", 4);
+        } else {
+            append("false", 5);
+        }
+        if (has(Flag_QUOTE_BOOLEAN_VALUES)) { put(quoteChar); }
+    }
+
+    template<uint32_t Flags>
+    template<typename T>
+    void BasicWriter<Flags>::writeArray(const T* values, size_t count) {
+        static_assert(std::is_arithmetic_v<T> && !std::is_same_v<T, bool>, "writeArray takes numbers");
+
+        auto cw = vector();
+        bool plain = !has(Flag_PRETTY_PRINT) && !has(Flag_QUOTE_NUMERIC_VALUES);
+        size_t i = 0;
+        while (i < count) {
+            size_t fit = plain ? (size_t)(_end - _pos) / (MAX_NUMBER_LENGTH + 1) : 0;
+            if (fit == 0) {
+                cw.next();
+                printNumeric(values[i++]);
+                continue;
+            }
+
+            size_t stop = std::min(count, i + fit);
+            char* p = _pos;
+            for (; i < stop; i++) {
+                if (i > 0) { *p++ = ','; }
+                p = std::to_chars(p, p + MAX_NUMBER_LENGTH, values[i]).ptr;
+            }
+            _pos = p;
+            cw._first = false;
+        }
+    }
+
+    template<uint32_t Flags>
+    inline bool BasicWriter<Flags>::isClean(std::string_view value, uint32_t classes) {
+        if (value.empty()) { return false; }
+        if (has(Flag_EXTENDED_SAFE_CHARS)) {
+            return (classes & (Class_NOT_EXTENDED_CLEAN | Class_COMMENT_START)) == 0;
+        }
+        return (classes & Class_NOT_CLEAN) == 0;
+    }
+
+    template<uint32_t Flags>
+    inline void BasicWriter<Flags>::printCleanIfPossible(std::string_view value) {
+        uint32_t classes = classifyString(value.data(), value.size());
+        if (isClean(value, classes)) {
+            printClean(value);
+        }
+        else {
+            printQuoted(value, classes);
+        }
+    }
+
+    template<uint32_t Flags>
+    inline void BasicWriter<Flags>::printClean(std::string_view value) {
+        append(value.data(), value.size());
+    }
+
+    template<uint32_t Flags>
+    inline char BasicWriter<Flags>::decideQuoteChar(uint32_t classes) {
+        char preferredQuotes = has(Flag_PREFER_SINGLE_QUOTES) ? '\'' : '"';
+        if (!has(Flag_FLEXIBLE_QUOTES)) {
+            return preferredQuotes;
+        }
+
+        switch (classes & (Class_SINGLE_QUOTE | Class_DOUBLE_QUOTE)) {
+        case Class_SINGLE_QUOTE:
+            return '"';
+        case Class_DOUBLE_QUOTE:
+            return '\'';
+        default:
+            return preferredQuotes;
+        }
+    }
+
+    template<uint32_t Flags>
+    inline void BasicWriter<Flags>::printQuoted(std::string_view value) {
+        printQuoted(value, classifyString(value.data(), value.size()));
+    }
+
+    template<uint32_t Flags>
+    inline void BasicWriter<Flags>::printQuoted(std::string_view value, uint32_t classes) {
+        char quoteChar = decideQuoteChar(classes);
+        uint32_t quoteClass = quoteChar == '"' ? Class_DOUBLE_QUOTE : Class_SINGLE_QUOTE;
+        put(quoteChar);
+        if ((classes & (Class_ESCAPE | quoteClass)) == 0) {
+            append(value.data(), value.size());
+            put(quoteChar);
+            return;
+        }
+
+        const char* p = value.data();
+        const char* end = p + value.size();
+        while (true) {
+            size_t clean = findEscape(p, end - p, quoteChar);
+            append(p, clean);
+            p += clean;
+            if (p == end) {
+                break;
+            }
+
+            char c = *p++;
+            if (c == quoteChar) {
+                put('\\');
+                put(quoteChar);
+            } else {
+                char escape[4];
+                append(escape, writeEscape((unsigned char)c, escape));
+            }
+        }
+        put(quoteChar);
+    }
+
+#if KESON_ENABLE_ENCODE_CACHE
+    template<uint32_t Flags>
+    bool BasicWriter<Flags>::printCached(const Node& node) {
+        auto cached = node.cachedEncoding(flags(), _depth);
+        if (cached == nullptr) {
+            return false;
+        }
+        append(cached->data(), cached->size());
+        endValue();
+        return true;
+    }
+
+    template<uint32_t Flags>
+    size_t BasicWriter<Flags>::beginRecording() {
+        if (_recordingDepth++ == 0) {
+            _recording.clear();
+            _recordingStart = _flushed;
+        }
+        return size();
+    }
+
+    template<uint32_t Flags>
+    void BasicWriter<Flags>::endRecording(size_t start, const Node& node) {
+        // Output dropped for lack of room cannot be cached
+        if (_dropped == 0) {
+            // Output before _flushed is in _recording, the rest is still buffered
+            std::string bytes;
+            bytes.reserve(size() - start);
+            if (start < _flushed) {
+                bytes.append(_recording, start - _recordingStart, std::string::npos);
+            }
+            bytes.append(_begin + (std::max(start, _flushed) - _flushed), _pos);
+            node.setCachedEncoding(flags(), _depth, std::move(bytes));
+        }
+
+        if (--_recordingDepth == 0) {
+            _recording.clear();
+        }
+    }
+#endif
+
+    template<uint32_t Flags>
+    void encode(BasicWriter<Flags>& w, const Node& node) {
+        if (node.isAtom()) {
+            w = node.atom();
+        }
+        else if (node.isVector() || node.isMap()) {
+#if KESON_ENABLE_ENCODE_CACHE
+            if (w.printCached(node)) {
+                return;
+            }
+            bool record = node.cachesEncoding();
+            size_t start = record ? w.beginRecording() : 0;
+#endif
+            if (node.isVector()) {
+                auto cw = w.vector();
+                for (auto& child : node) {
+                    encode(cw.next(), child);
+                }
+            }
+            else {
+                auto cw = w.map();
+                for (auto& keyChild : node.map()) {
+                    if (!keyChild.second.isNull()) {
+                        encode(cw[keyChild.first], keyChild.second);
+                    }
+                }
+            }
+#if KESON_ENABLE_ENCODE_CACHE
+            if (record) {
+                w.endRecording(start, node);
+            }
+#endif
+        }
+        else if (node.isPacked()) {
+            // Quoting string values quotes atoms even when they hold numbers, and so the
+            // elements of a packed array, which would be atoms if decoded unpacked
+            std::visit([&](auto& values) {
+                if (!w.has(Flag_QUOTE_STRING_VALUES)) {
+                    w.writeArray(values.data(), values.size());
+                    return;
+                }
+
+                auto cw = w.vector();
+                char text[BasicWriter<Flags>::MAX_NUMBER_LENGTH];
+                for (auto value : values) {
+                    char* end = std::to_chars(text, text + sizeof(text), value).ptr;
+                    cw.next() = std::string_view(text, end - text);
+                }
+            }, node.packed());
+        }
+        else {
+            assert(node.isNull());
+            w = "null";
+        }
+    }
+
+    template<uint32_t Flags>
+    void encodeDocument(BasicWriter<Flags>& w, const Node& node) {
+        encode(w, node);
+
+        if ((w.flags() & Flag_PRETTY_PRINT) != 0)
+        {
+            w.printNewline();
+        }
+    }
+
+    template<uint32_t Flags>
+    void encode(std::ostream& s, const Node& node) {
+        BasicWriter<Flags> w(s);
+        encodeDocument(w, node);
+    }
+
+    template<uint32_t Flags>
+    std::string encode(const Node& node) {
+        std::string result;
+        StringSink sink(result);
+        {
+            BasicWriter<Flags> w(sink);
+            encodeDocument(w, node);
+        }
+        return result;
+    }
+
+    extern template class BasicWriter<Flags_DYNAMIC>;
+    extern template void encode(Writer& w, const Node& node);
+}
@@ -0,0 +1,291 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include <cassert>
+#include <stdexcept>
+#include <initializer_list>
+
+#include "conf.h"
+#include "key.h"
+
+namespace keson
+{
+    // Map from string keys to values that keeps its entries in insertion order in a
+    // single contiguous vector.
+    //
+    // Small maps are searched linearly over a parallel array of key hashes. Once a map
+    // grows past INDEX_THRESHOLD entries an open addressing index into the entry vector
+    // is built and kept up to date on insertion. Erasing preserves the order of the
+    // remaining entries and rebuilds the index, so it costs O(n).
+    //
+    // Keys must not be modified through iterators.
+    template<typename T>
+    class FlatMap {
+    public:
+        using key_type       = std::string;
+        using mapped_type    = T;
+        using value_type     = std::pair<std::string, T>;
+        using iterator       = typename std::vector<value_type>::iterator;
+        using const_iterator = typename std::vector<value_type>::const_iterator;
+
+        static constexpr size_t INDEX_THRESHOLD = 16;
+
+        FlatMap() {}
+
+        FlatMap(std::initializer_list<value_type> init) {
+            for (auto& entry : init) {
+                insert(entry);
+            }
+        }
+
+        iterator begin()                              { return _entries.begin(); }
+        const_iterator begin() const                  { return _entries.begin(); }
+        iterator end()                                { return _entries.end(); }
+        const_iterator end() const                    { return _entries.end(); }
+
+        size_t size() const                           { return _entries.size(); }
+        bool empty() const                            { return _entries.empty(); }
+
+        void clear() {
+            _entries.clear();
+            _hashes.clear();
+            _index.clear();
+        }
+
+        void reserve(size_t count) {
+            _entries.reserve(count);
+            _hashes.reserve(count);
+        }
+
+        // Bytes allocated for the entry, hash and index arrays, not counting what the
+        // keys and values own themselves.
+        size_t capacityBytes() const {
+            return _entries.capacity() * sizeof(value_type)
+                + _hashes.capacity() * sizeof(uint64_t)
+                + _index.capacity() * sizeof(uint32_t);
+        }
+
+        // Copies the map with every value produced by copyValue(value), reusing the
+        // computed hashes and index.
+        template<typename F>
+        FlatMap copyWith(F copyValue) const {
+            FlatMap result;
+            result._entries.reserve(_entries.size());
+            for (auto& entry : _entries) {
+                result._entries.emplace_back(entry.first, copyValue(entry.second));
+            }
+            result._hashes = _hashes;
+            result._index = _index;
+            return result;
+        }
+
+        iterator find(std::string_view key) {
+            size_t i = indexOf(key, hashKey(key));
+            return i == NOT_FOUND ? end() : begin() + i;
+        }
+
+        const_iterator find(std::string_view key) const {
+            size_t i = indexOf(key, hashKey(key));
+            return i == NOT_FOUND ? end() : begin() + i;
+        }
+
+        iterator find(const Key& key) {
+            size_t i = indexOf(key.name(), key.hash());
+            return i == NOT_FOUND ? end() : begin() + i;
+        }
+
+        const_iterator find(const Key& key) const {
+            size_t i = indexOf(key.name(), key.hash());
+            return i == NOT_FOUND ? end() : begin() + i;
+        }
+
+        size_t count(std::string_view key) const {
+            return indexOf(key, hashKey(key)) == NOT_FOUND ? 0 : 1;
+        }
+
+        T& at(std::string_view key) {
+            size_t i = indexOf(key, hashKey(key));
+            if (i == NOT_FOUND) { throw std::out_of_range("FlatMap::at"); }
+            return _entries[i].second;
+        }
+
+        const T& at(std::string_view key) const {
+            size_t i = indexOf(key, hashKey(key));
+            if (i == NOT_FOUND) { throw std::out_of_range("FlatMap::at"); }
+            return _entries[i].second;
+        }
+
+        T& operator[](std::string_view key) {
+            uint64_t h = hashKey(key);
+            size_t i = indexOf(key, h);
+            if (i == NOT_FOUND) {
+                i = append(std::string(key), h, T());
+            }
+            return _entries[i].second;
+        }
+
+        T& operator[](std::string&& key) {
+            uint64_t h = hashKey(key);
+            size_t i = indexOf(key, h);
+            if (i == NOT_FOUND) {
+                i = append(std::move(key), h, T());
+            }
+            return _entries[i].second;
+        }
+
+        T& operator[](const char* key) {
+            return (*this)[std::string_view(key)];
+        }
+
+        T& operator[](const Key& key) {
+            size_t i = indexOf(key.name(), key.hash());
+            if (i == NOT_FOUND) {
+                i = append(std::string(key.name()), key.hash(), T());
+            }
+            return _entries[i].second;
+        }
+
+        template<typename... Args>
+        std::pair<iterator, bool> try_emplace(std::string key, Args&&... args) {
+            uint64_t h = hashKey(key);
+            size_t i = indexOf(key, h);
+            if (i != NOT_FOUND) {
+                return { begin() + i, false };
+            }
+            i = append(std::move(key), h, T(std::forward<Args>(args)...));
+            return { begin() + i, true };
+        }
+
+        std::pair<iterator, bool> emplace(std::string key, T value) {
+            return try_emplace(std::move(key), std::move(value));
+        }
+
+        std::pair<iterator, bool> insert(value_type entry) {
+            return try_emplace(std::move(entry.first), std::move(entry.second));
+        }
+
+        iterator erase(const_iterator pos) {
+            size_t i = pos - begin();
+            _entries.erase(_entries.begin() + i);
+            _hashes.erase(_hashes.begin() + i);
+            rebuildIndex();
+            return begin() + i;
+        }
+
+        iterator erase(const_iterator first, const_iterator last) {
+            size_t i = first - begin();
+            size_t j = last - begin();
+            _entries.erase(_entries.begin() + i, _entries.begin() + j);
+            _hashes.erase(_hashes.begin() + i, _hashes.begin() + j);
+            rebuildIndex();
+            return begin() + i;
+        }
+
+        // Exchanges the positions of two entries in the iteration order.
+        void swapEntries(size_t i, size_t j) {
+            if (i == j) { return; }
+            if (!_index.empty()) {
+                uint32_t& si = _index[slotOfEntry(i)];
+                uint32_t& sj = _index[slotOfEntry(j)];
+                std::swap(si, sj);
+            }
+            std::swap(_entries[i], _entries[j]);
+            std::swap(_hashes[i], _hashes[j]);
+        }
+
+        size_t erase(std::string_view key) {
+            auto it = find(key);
+            if (it == end()) { return 0; }
+            erase(it);
+            return 1;
+        }
+
+    private:
+        static constexpr size_t NOT_FOUND = ~(size_t)0;
+
+        // Index slots hold an entry index plus one, zero marks an empty slot.
+        static constexpr uint32_t EMPTY_SLOT = 0;
+
+        size_t indexOf(std::string_view key, uint64_t h) const {
+            if (_index.empty()) {
+                const uint64_t* hashes = _hashes.data();
+                for (size_t i = 0, n = _hashes.size(); i < n; i++) {
+                    if (hashes[i] == h && _entries[i].first == key) {
+                        return i;
+                    }
+                }
+                return NOT_FOUND;
+            }
+
+            size_t mask = _index.size() - 1;
+            for (size_t slot = slotOf(h, mask); ; slot = (slot + 1) & mask) {
+                uint32_t s = _index[slot];
+                if (s == EMPTY_SLOT) {
+                    return NOT_FOUND;
+                }
+                if (_hashes[s - 1] == h && _entries[s - 1].first == key) {
+                    return s - 1;
+                }
+            }
+        }
+
+        size_t append(std::string key, uint64_t h, T value) {
+            size_t i = _entries.size();
+            assert(i < UINT32_MAX);
+            _entries.emplace_back(std::move(key), std::move(value));
+            _hashes.push_back(h);
+            if (!_index.empty() && _entries.size() * 2 <= _index.size()) {
+                insertSlot(i);
+            }
+            else if (_entries.size() > INDEX_THRESHOLD) {
+                rebuildIndex();
+            }
+            return i;
+        }
+
+        void rebuildIndex() {
+            _index.clear();
+            if (_entries.size() <= INDEX_THRESHOLD) {
+                return;
+            }
+            size_t capacity = 1;
+            while (capacity < _entries.size() * 4) {
+                capacity <<= 1;
+            }
+            _index.assign(capacity, EMPTY_SLOT);
+            for (size_t i = 0; i < _entries.size(); i++) {
+                insertSlot(i);
+            }
+        }
+
+        void insertSlot(size_t i) {
+            size_t mask = _index.size() - 1;
+            size_t slot = slotOf(_hashes[i], mask);
+            while (_index[slot] != EMPTY_SLOT) {
+                slot = (slot + 1) & mask;
+            }
+            _index[slot] = (uint32_t)(i + 1);
+        }
+
+        size_t slotOfEntry(size_t i) const {
+            size_t mask = _index.size() - 1;
+            size_t slot = slotOf(_hashes[i], mask);
+            while (_index[slot] != i + 1) {
+                slot = (slot + 1) & mask;
+            }
+            return slot;
+        }
+
+        static size_t slotOf(uint64_t h, size_t mask) {
+            return (size_t)(h ^ (h >> 32)) & mask;
+        }
+
+        std::vector<value_type> _entries;
+        std::vector<uint64_t> _hashes;
+        std::vector<uint32_t> _index;
+    };
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <string_view>
+#include <cstdint>
+
+#include "conf.h"
+
+namespace keson
+{
+    // 64-bit FNV-1a
+    constexpr uint64_t hashKey(std::string_view key) {
+        uint64_t h = 0xcbf29ce484222325ull;
+        for (char c : key) {
+            h ^= (uint8_t)c;
+            h *= 0x100000001b3ull;
+        }
+        return h;
+    }
+
+    // A map key together with its precomputed hash, for keys that are looked up over and
+    // over again. Keys built from literals can be constexpr:
+    //
+    //     static constexpr keson::Key VALUE("value");
+    //     float v = param[VALUE];
+    //
+    // Key does not own its characters; they must outlive it.
+    class Key {
+    public:
+        constexpr explicit Key(std::string_view name)
+            : _name(name)
+            , _hash(hashKey(name))
+        { }
+
+        constexpr explicit Key(const char* name)
+            : Key(std::string_view(name))
+        { }
+
+        constexpr std::string_view name() const { return _name; }
+        constexpr uint64_t hash() const         { return _hash; }
+
+    private:
+        std::string_view _name;
+        uint64_t _hash;
+    };
+}
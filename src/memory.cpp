@@ -0,0 +1,105 @@
+#include "memory.h"
+
+#include <unordered_set>
+
+namespace keson
+{
+    // Control block and reference counts that make_shared puts in front of a box
+    static const size_t SHARED_OVERHEAD = 2 * sizeof(void*) + 2 * sizeof(long);
+
+    static size_t stringBytes(const std::string& s) {
+        static const size_t INLINE_CAPACITY = std::string().capacity();
+        return s.capacity() > INLINE_CAPACITY ? s.capacity() + 1 : 0;
+    }
+
+    class MemoryCounter {
+    public:
+        explicit MemoryCounter(MemoryUsage& usage) : _usage(usage) {}
+
+        void count(const Node& node) {
+            if (node.isAtom()) {
+                _usage.atoms += stringBytes(node.atom());
+            }
+            else if (node.isVector()) {
+                auto& shared = std::get<Node::SharedVector>(node._value);
+                if (!firstVisit(shared)) { return; }
+                _usage.vectors += SHARED_OVERHEAD + sizeof(*shared) + shared->value.capacity() * sizeof(Node);
+                countCache(*shared);
+                for (auto& child : shared->value) {
+                    count(child);
+                }
+            }
+            else if (node.isMap()) {
+                auto& shared = std::get<Node::SharedMap>(node._value);
+                if (!firstVisit(shared)) { return; }
+                _usage.maps += SHARED_OVERHEAD + sizeof(*shared) + shared->value.capacityBytes();
+                countCache(*shared);
+                for (auto& keyChild : shared->value) {
+                    _usage.maps += stringBytes(keyChild.first);
+                    count(keyChild.second);
+                }
+            }
+            else if (node.isPacked()) {
+                auto& shared = std::get<Node::SharedPacked>(node._value);
+                if (!firstVisit(shared)) { return; }
+                _usage.packed += SHARED_OVERHEAD + sizeof(*shared) + std::visit([](auto& values) {
+                    return values.capacity() * sizeof(values[0]);
+                }, shared->value);
+
+                if (auto elements = std::atomic_load(&shared->elements)) {
+                    _usage.cache += SHARED_OVERHEAD + sizeof(Node::Vector) + elements->capacity() * sizeof(Node);
+                    for (auto& element : *elements) {
+                        _usage.cache += stringBytes(element.atom());
+                    }
+                }
+            }
+        }
+
+    private:
+        template<typename T>
+        void countCache(const Node::Box<T>& box) {
+#if KESON_ENABLE_ENCODE_CACHE
+            // Copies of a box share its encoding
+            auto encoding = std::atomic_load(&box.encoding);
+            if (encoding != nullptr && _seen.insert(encoding.get()).second) {
+                _usage.cache += SHARED_OVERHEAD + sizeof(*encoding) + stringBytes(encoding->bytes);
+            }
+#else
+            (void)box;
+#endif
+        }
+
+        // Boxes only snapshots can share are tracked, the rest are visited exactly once
+        template<typename T>
+        bool firstVisit(const std::shared_ptr<T>& shared) {
+            return shared.use_count() == 1 || _seen.insert(shared.get()).second;
+        }
+
+        MemoryUsage& _usage;
+        std::unordered_set<const void*> _seen;
+    };
+
+    MemoryUsage memoryUsage(const Node& node) {
+        MemoryUsage usage;
+        MemoryCounter counter(usage);
+        counter.count(node);
+
+        if (node.isMap()) {
+            // Each entry is measured on its own, so a container shared between two
+            // entries counts towards both
+            for (auto& keyChild : node.map()) {
+                MemoryUsage entry;
+                MemoryCounter(entry).count(keyChild.second);
+                usage.byKey.emplace_back(keyChild.first, stringBytes(keyChild.first) + entry.total());
+            }
+        }
+        return usage;
+    }
+
+#if KESON_ENABLE_MEMORY_COUNTER
+    std::atomic<int64_t>& memoryCounter() {
+        static std::atomic<int64_t> counter { 0 };
+        return counter;
+    }
+#endif
+}
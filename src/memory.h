@@ -0,0 +1,50 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <atomic>
+#include <cstdint>
+
+#include "conf.h"
+#include "node.h"
+
+namespace keson
+{
+    // Heap bytes owned by a tree, split by the kind of node that owns them. Capacity is
+    // counted rather than size, so reserved but unused space shows up, and each
+    // vector, map and packed array includes an estimate for its shared box. Containers
+    // shared with snapshots are counted once per call. The bookkeeping of the allocator
+    // itself is not included.
+    struct MemoryUsage {
+        // String buffers of atoms too long for the small string optimisation
+        size_t atoms = 0;
+        // Element arrays of vectors
+        size_t vectors = 0;
+        // Entry, hash and index arrays of maps, and their keys
+        size_t maps = 0;
+        // Element arrays of packed arrays
+        size_t packed = 0;
+        // Values kept next to the data to speed up reading it, which come and go as the
+        // tree is read and written: the element Nodes the const vector accessors make
+        // for packed arrays and, with KESON_ENABLE_ENCODE_CACHE, encoded output
+        size_t cache = 0;
+
+        // For a map at the root, the bytes owned by each entry's key and value, in
+        // map order. Empty otherwise.
+        std::vector<std::pair<std::string, size_t>> byKey;
+
+        size_t total() const { return atoms + vectors + maps + packed + cache; }
+        size_t withoutCache() const { return total() - cache; }
+    };
+
+    MemoryUsage memoryUsage(const Node& node);
+
+#if KESON_ENABLE_MEMORY_COUNTER
+    // Running total of memoryUsage without the cache over the trees produced by decode,
+    // plus the change each Decoder::decodeInto makes to its tree. Nothing else updates
+    // it, so subtract memoryUsage(node).withoutCache() when releasing a decoded
+    // document to track what is still alive.
+    std::atomic<int64_t>& memoryCounter();
+#endif
+}
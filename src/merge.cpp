@@ -0,0 +1,51 @@
+#include "merge.h"
+
+#include <iterator>
+#include <type_traits>
+
+namespace keson
+{
+    void merge(Node& base, Node&& overlay, uint32_t flags) {
+        if (overlay.isNull()) {
+            return;
+        }
+
+        if (overlay.isMap() && base.isMap() && (flags & Merge_REPLACE_MAPS) == 0) {
+            auto& baseMap = base.map();
+            for (auto& keyChild : overlay.map()) {
+                if (keyChild.second.isNull()) {
+                    if ((flags & Merge_NULL_ERASES) != 0) {
+                        baseMap.erase(keyChild.first);
+                    }
+                    continue;
+                }
+
+                auto it = baseMap.find(keyChild.first);
+                if (it == baseMap.end()) {
+                    baseMap.try_emplace(std::move(keyChild.first), std::move(keyChild.second));
+                }
+                else if (it->second.isNull()) {
+                    it->second = std::move(keyChild.second);
+                }
+                else {
+                    merge(it->second, std::move(keyChild.second), flags);
+                }
+            }
+        }
+        else if ((overlay.isVector() || overlay.isPacked()) && (base.isVector() || base.isPacked()) && (flags & Merge_CONCATENATE_VECTORS) != 0) {
+            if (base.isPacked() && overlay.isPacked() && base.packed().index() == overlay.packed().index()) {
+                std::visit([&](auto& baseValues) {
+                    auto& overlayValues = std::get<std::decay_t<decltype(baseValues)>>(overlay.packed());
+                    baseValues.insert(baseValues.end(), overlayValues.begin(), overlayValues.end());
+                }, base.packed());
+                return;
+            }
+            auto& baseVector = base.vector();
+            auto& overlayVector = overlay.vector();
+            baseVector.insert(baseVector.end(), std::make_move_iterator(overlayVector.begin()), std::make_move_iterator(overlayVector.end()));
+        }
+        else {
+            base = std::move(overlay);
+        }
+    }
+}
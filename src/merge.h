@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdint>
+
+#include "conf.h"
+#include "node.h"
+
+namespace keson
+{
+    // Append overlay vectors to base vectors instead of replacing them
+    static const uint32_t Merge_CONCATENATE_VECTORS = (1 << 0);
+    // Replace base maps with overlay maps instead of merging them key by key
+    static const uint32_t Merge_REPLACE_MAPS        = (1 << 1);
+    // Remove base entries whose overlay value is null instead of leaving them alone
+    static const uint32_t Merge_NULL_ERASES         = (1 << 2);
+
+    // Merges overlay into base. By default maps merge recursively and everything else,
+    // vectors included, is replaced by the overlay value.
+    //
+    // Overlay subtrees are moved into base rather than copied, so the time taken is
+    // proportional to the size of the overlay, not of base. Overlay is left in an
+    // unspecified state.
+    void merge(Node& base, Node&& overlay, uint32_t flags = 0);
+}
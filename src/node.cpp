@@ -1,223 +1,710 @@
-#include <cassert>
-
-#include "node.h"
-#include "util.h"
-
-namespace keson
-{
-	const Node Node::NULL_NODE;
-
-	Node::Node() {}
-	Node::Node(std::string value)                            : _value(std::move(value)) {}
-	Node::Node(const char* value)                            : _value(std::string(value)) {}
-	Node::Node(Vector value)                                 : _value(std::move(value)) {}
-	Node::Node(Map value)                                    : _value(std::move(value)) {}
-	Node::Node(int8_t value)                                 : _value(to_string(value)) {}
-	Node::Node(uint8_t value)                                : _value(to_string(value)) {}
-	Node::Node(int16_t value)                                : _value(to_string(value)) {}
-	Node::Node(uint16_t value)                               : _value(to_string(value)) {}
-	Node::Node(int32_t value)                                : _value(to_string(value)) {}
-	Node::Node(uint32_t value)                               : _value(to_string(value)) {}
-	Node::Node(int64_t value)                                : _value(to_string(value)) {}
-	Node::Node(uint64_t value)                               : _value(to_string(value)) {}
-	Node::Node(float value)                                  : _value(to_string(value)) {}
-	Node::Node(double value)                                 : _value(to_string(value)) {}
-	Node::Node(bool value)                                   : _value(to_string(value)) {}
-#if KESON_ENABLE_WSTRING
-	Node::Node(const wchar_t* value)                         : _value(to_utf8(value)) {}
-	Node::Node(const std::wstring& value)                    : _value(to_utf8(value)) {}
-#endif
-
-	bool Node::isNull() const                                { return std::holds_alternative<Null>(_value); }
-	bool Node::isAtom() const                                { return std::holds_alternative<Atom>(_value); }
-	bool Node::isVector() const                              { return std::holds_alternative<Vector>(_value); }
-	bool Node::isMap() const                                 { return std::holds_alternative<Map>(_value); }
-
-	const Node::Atom& Node::atom() const {
-		return std::get<Atom>(_value);
-	}
-
-	Node::Atom& Node::atom() {
-		if (isNull()) { _value = Atom(); }
-		return std::get<Atom>(_value);
-	}
-
-	std::string Node::value_or(std::string fallback) const   { return !isAtom() ? fallback : atom(); }
-    int8_t      Node::value_or(int8_t fallback) const        { return !isAtom() ? fallback : (int8_t)(*this); }
-    uint8_t     Node::value_or(uint8_t fallback) const       { return !isAtom() ? fallback : (uint8_t)(*this); }
-    int16_t     Node::value_or(int16_t fallback) const       { return !isAtom() ? fallback : (int16_t)(*this); }
-    uint16_t    Node::value_or(uint16_t fallback) const      { return !isAtom() ? fallback : (uint16_t)(*this); }
-    int32_t     Node::value_or(int32_t fallback) const       { return !isAtom() ? fallback : (int32_t)(*this); }
-    uint32_t    Node::value_or(uint32_t fallback) const      { return !isAtom() ? fallback : (uint32_t)(*this); }
-    int64_t     Node::value_or(int64_t fallback) const       { return !isAtom() ? fallback : (int64_t)(*this); }
-    uint64_t    Node::value_or(uint64_t fallback) const      { return !isAtom() ? fallback : (uint64_t)(*this); }
-    float       Node::value_or(float fallback) const         { return !isAtom() ? fallback : (float)(*this); }
-    double      Node::value_or(double fallback) const        { return !isAtom() ? fallback : (double)(*this); }
-    bool        Node::value_or(bool fallback) const          { return !isAtom() ? fallback : (bool)(*this); }
-#if KESON_ENABLE_WSTRING
-	std::wstring Node::value_or(std::wstring fallback) const { return !isAtom() ? fallback : from_utf8(atom()); }
-#endif
-
-	Node::operator std::string() const                       { return atom(); }
-	Node::operator int8_t() const                            { return from_string<int8_t>(atom());   }
-	Node::operator uint8_t() const                           { return from_string<uint8_t>(atom());  }
-	Node::operator int16_t() const                           { return from_string<int16_t>(atom());  }
-	Node::operator uint16_t() const                          { return from_string<uint16_t>(atom()); }
-	Node::operator int32_t() const                           { return from_string<int32_t>(atom());  }
-	Node::operator uint32_t() const                          { return from_string<uint32_t>(atom()); }
-	Node::operator int64_t() const                           { return from_string<int64_t>(atom());  }
-	Node::operator uint64_t() const                          { return from_string<uint64_t>(atom()); }
-	Node::operator float() const                             { return from_string<float>(atom());    }
-	Node::operator double() const                            { return from_string<double>(atom());   }
-	Node::operator bool() const                              { return from_string<bool>(atom());     }
-#if KESON_ENABLE_WSTRING
-	Node::operator std::wstring() const                      { return from_utf8(atom()); }
-#endif
-
-	void Node::operator=(std::string value)                  { _value = std::move(value); }
-	void Node::operator=(const char* value)                  { _value = std::string(value); }
-	void Node::operator=(int8_t value)                       { _value = to_string(value); }
-	void Node::operator=(uint8_t value)                      { _value = to_string(value); }
-	void Node::operator=(int16_t value)                      { _value = to_string(value); }
-	void Node::operator=(uint16_t value)                     { _value = to_string(value); }
-	void Node::operator=(int32_t value)                      { _value = to_string(value); }
-	void Node::operator=(uint32_t value)                     { _value = to_string(value); }
-	void Node::operator=(int64_t value)                      { _value = to_string(value); }
-	void Node::operator=(uint64_t value)                     { _value = to_string(value); }
-	void Node::operator=(float value)                        { _value = to_string(value); }
-	void Node::operator=(double value)                       { _value = to_string(value); }
-	void Node::operator=(bool value)                         { _value = to_string(value); }
-#if KESON_ENABLE_WSTRING
-	void Node::operator=(const std::wstring& value)          { _value = to_utf8(value); }
-	void Node::operator=(const wchar_t* value)               { _value = to_utf8(value); }
-#endif
-
-	const Node::Vector& Node::vector() const {
-		return std::get<Vector>(_value);
-	}
-
-	Node::Vector& Node::vector() {
-		if (isNull()) { _value = Vector(); }
-		return std::get<Vector>(_value);
-	}
-
-	size_t Node::length() const {
-		if (isVector()) {
-			return vector().size();
-		}
-		else if (isNull()) {
-			return 0;
-		}
-		else {
-			return 1;
-		}
-	}
-
-	const Node* Node::begin() const {
-		if (isVector()) {
-			return vector().data();
-		}
-		else if (isNull()) {
-			return nullptr;
-		}
-		else {
-			return this;
-		}
-	}
-
-	Node* Node::begin() {
-		if (isVector()) {
-			return vector().data();
-		}
-		else if (isNull()) {
-			return nullptr;
-		}
-		else {
-			return this;
-		}
-	}
-
-	const Node* Node::end() const {
-		if (isVector()) {
-			return vector().data() + vector().size();
-		}
-		else if (isNull()) {
-			return nullptr;
-		}
-		else {
-			return this + 1;
-		}
-	}
-
-	Node* Node::end() {
-		if (isVector()) {
-			return vector().data() + vector().size();
-		}
-		else if (isNull()) {
-			return nullptr;
-		}
-		else {
-			return this + 1;
-		}
-	}
-
-	Node& Node::operator[](size_t pos) {
-		if (vector().size() <= pos) {
-			vector().resize(pos + 1);
-		}
-		return vector()[pos];
-	}
-
-	const Node& Node::operator[](size_t pos) const {
-		return vector().at(pos);
-	}
-
-	void Node::push_back(Node node) {
-		vector().emplace_back(std::move(node));
-	}
-
-	Node& Node::push_back() {
-		vector().emplace_back(Node());
-		return vector().back();
-	}
-
-	const Node::Map& Node::map() const {
-		return std::get<Map>(_value);
-	}
-
-	Node::Map& Node::map() {
-		if (isNull()) { _value = Map(); }
-		return std::get<Map>(_value);
-	}
-
-	const Node& Node::operator[](const std::string& key) const {
-		if (isMap()) {
-			auto& v = map();
-			auto it = v.find(key);
-			if (it != v.end()) {
-				return it->second;
-			}
-		}
-		return Node::NULL_NODE;
-	}
-
-	Node& Node::operator[](const std::string& key) {
-		return map()[key];
-	}
-
-	Node& Node::operator[](const char* key) {
-		return (*this)[std::string(key)];
-	}
-
-	const Node& Node::operator[](const char* key) const {
-		return (*this)[std::string(key)];
-	}
-
-	void swap(Node& a, Node& b) {
-		std::swap(a._value, b._value);
-	}
-}
-
-void std::swap(keson::Node& a, keson::Node& b) {
-	keson::swap(a, b);
-}
+#include <algorithm>
+#include <charconv>
+#include <cassert>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+
+#include "node.h"
+#include "util.h"
+
+namespace keson
+{
+	const Node Node::NULL_NODE;
+
+	Node::Node() {}
+	Node::Node(const Node& other)                            { *this = other; }
+	Node::Node(Node&& other) noexcept                        : _value(std::exchange(other._value, Null())) {}
+	Node::Node(std::string value)                            : _value(std::move(value)) {}
+	Node::Node(const char* value)                            : _value(std::string(value)) {}
+	Node::Node(Vector value)                                 : _value(std::make_shared<Box<Vector>>(std::move(value))) {}
+	Node::Node(Map value)                                    : _value(std::make_shared<Box<Map>>(std::move(value))) {}
+	Node::Node(std::vector<int32_t> value)                   : _value(std::make_shared<Box<Packed>>(std::move(value))) {}
+	Node::Node(std::vector<int64_t> value)                   : _value(std::make_shared<Box<Packed>>(std::move(value))) {}
+	Node::Node(std::vector<float> value)                     : _value(std::make_shared<Box<Packed>>(std::move(value))) {}
+	Node::Node(std::vector<double> value)                    : _value(std::make_shared<Box<Packed>>(std::move(value))) {}
+	Node::Node(int8_t value)                                 : _value(to_string(value)) {}
+	Node::Node(uint8_t value)                                : _value(to_string(value)) {}
+	Node::Node(int16_t value)                                : _value(to_string(value)) {}
+	Node::Node(uint16_t value)                               : _value(to_string(value)) {}
+	Node::Node(int32_t value)                                : _value(to_string(value)) {}
+	Node::Node(uint32_t value)                               : _value(to_string(value)) {}
+	Node::Node(int64_t value)                                : _value(to_string(value)) {}
+	Node::Node(uint64_t value)                               : _value(to_string(value)) {}
+	Node::Node(float value)                                  : _value(to_string(value)) {}
+	Node::Node(double value)                                 : _value(to_string(value)) {}
+	Node::Node(bool value)                                   : _value(to_string(value)) {}
+#if KESON_ENABLE_WSTRING
+	Node::Node(const wchar_t* value)                         : _value(to_utf8(value)) {}
+	Node::Node(const std::wstring& value)                    : _value(to_utf8(value)) {}
+#endif
+
+	Node& Node::operator=(const Node& other) {
+		if (other.isVector()) {
+			_value = std::make_shared<Box<Vector>>(*std::get<SharedVector>(other._value));
+		}
+		else if (other.isMap()) {
+			_value = std::make_shared<Box<Map>>(*std::get<SharedMap>(other._value));
+		}
+		else if (other.isPacked()) {
+			_value = std::make_shared<Box<Packed>>(*std::get<SharedPacked>(other._value));
+		}
+		else {
+			_value = other._value;
+		}
+		return *this;
+	}
+
+	// Moving a container leaves the source null rather than holding an empty box pointer
+	Node& Node::operator=(Node&& other) noexcept {
+		if (this != &other) {
+			_value = std::exchange(other._value, Null());
+		}
+		return *this;
+	}
+
+	Node Node::snapshot() const {
+#if KESON_ENABLE_HASH_CACHE || KESON_ENABLE_ENCODE_CACHE
+		seal();
+#endif
+		Node result;
+		result._value = _value;
+		return result;
+	}
+
+#if KESON_ENABLE_HASH_CACHE || KESON_ENABLE_ENCODE_CACHE
+	void Node::seal() const {
+		if (isVector()) {
+			auto& box = *std::get<SharedVector>(_value);
+			if (box.sealed()) { return; }
+			for (auto& child : box.value) {
+				child.seal();
+			}
+			box.exposed.store(false, std::memory_order_relaxed);
+		}
+		else if (isMap()) {
+			auto& box = *std::get<SharedMap>(_value);
+			if (box.sealed()) { return; }
+			for (auto& keyChild : box.value) {
+				keyChild.second.seal();
+			}
+			box.exposed.store(false, std::memory_order_relaxed);
+		}
+		else if (isPacked()) {
+			std::get<SharedPacked>(_value)->exposed.store(false, std::memory_order_relaxed);
+		}
+	}
+#endif
+
+	bool Node::isNull() const                                { return std::holds_alternative<Null>(_value); }
+	bool Node::isAtom() const                                { return std::holds_alternative<Atom>(_value); }
+	bool Node::isVector() const                              { return std::holds_alternative<SharedVector>(_value); }
+	bool Node::isMap() const                                 { return std::holds_alternative<SharedMap>(_value); }
+	bool Node::isPacked() const                              { return std::holds_alternative<SharedPacked>(_value); }
+
+	static size_t packedSize(const Node::Packed& packed) {
+		return std::visit([](auto& v) { return v.size(); }, packed);
+	}
+
+	// Formats element i the way the numeric constructors would, into a buffer of at
+	// least PACKED_BUFFER_SIZE bytes.
+	static const size_t PACKED_BUFFER_SIZE = 32;
+
+	static std::string_view formatPacked(const Node::Packed& packed, size_t i, char* buffer) {
+		return std::visit([&](auto& v) {
+			auto result = std::to_chars(buffer, buffer + PACKED_BUFFER_SIZE, v[i]);
+			assert(result.ec == (std::errc)0);
+			return std::string_view(buffer, result.ptr - buffer);
+		}, packed);
+	}
+
+	static uint64_t mixHash(uint64_t h) {
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdull;
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53ull;
+		h ^= h >> 33;
+		return h;
+	}
+
+	static uint64_t hashBytes(std::string_view s) {
+		uint64_t h = mixHash(s.size() + 0x9e3779b97f4a7c15ull);
+		size_t i = 0;
+		for (; i + 8 <= s.size(); i += 8) {
+			uint64_t word;
+			memcpy(&word, s.data() + i, 8);
+			h = mixHash(h ^ word);
+		}
+		uint64_t tail = 0;
+		memcpy(&tail, s.data() + i, s.size() - i);
+		return mixHash(h ^ tail);
+	}
+
+	static uint64_t hashAtom(std::string_view s) {
+		static const uint64_t ATOM_SEED = 0x61746f6d61746f6dull;
+		return mixHash(hashBytes(s) ^ ATOM_SEED);
+	}
+
+	uint64_t Node::hash() const {
+		static const uint64_t NULL_SEED   = 0x6e756c6c6e756c6cull;
+		static const uint64_t VECTOR_SEED = 0x766563746f720000ull;
+		static const uint64_t MAP_SEED    = 0x6d61700000000000ull;
+
+		if (isAtom()) {
+			return hashAtom(atom());
+		}
+		else if (isVector()) {
+			auto& box = *std::get<SharedVector>(_value);
+#if KESON_ENABLE_HASH_CACHE
+			uint64_t cached = box.cachedHash();
+			if (cached != 0) { return cached; }
+#endif
+			uint64_t h = VECTOR_SEED ^ box.value.size();
+			for (auto& child : box.value) {
+				h = mixHash(h + child.hash());
+			}
+			h += (h == 0);
+#if KESON_ENABLE_HASH_CACHE
+			box.cacheHash(h);
+#endif
+			return h;
+		}
+		else if (isMap()) {
+			auto& box = *std::get<SharedMap>(_value);
+#if KESON_ENABLE_HASH_CACHE
+			uint64_t cached = box.cachedHash();
+			if (cached != 0) { return cached; }
+#endif
+			uint64_t sum = 0;
+			uint64_t count = 0;
+			for (auto& keyChild : box.value) {
+				if (!keyChild.second.isNull()) {
+					sum += mixHash(hashBytes(keyChild.first) * 31 + keyChild.second.hash());
+					count += 1;
+				}
+			}
+			uint64_t h = mixHash(MAP_SEED ^ sum ^ mixHash(count));
+			h += (h == 0);
+#if KESON_ENABLE_HASH_CACHE
+			box.cacheHash(h);
+#endif
+			return h;
+		}
+		else if (isPacked()) {
+			// Hashed like the equivalent vector of atoms
+			auto& box = *std::get<SharedPacked>(_value);
+#if KESON_ENABLE_HASH_CACHE
+			uint64_t cached = box.cachedHash();
+			if (cached != 0) { return cached; }
+#endif
+			size_t size = packedSize(box.value);
+			uint64_t h = VECTOR_SEED ^ size;
+			char buffer[PACKED_BUFFER_SIZE];
+			for (size_t i = 0; i < size; i++) {
+				h = mixHash(h + hashAtom(formatPacked(box.value, i, buffer)));
+			}
+			h += (h == 0);
+#if KESON_ENABLE_HASH_CACHE
+			box.cacheHash(h);
+#endif
+			return h;
+		}
+		return NULL_SEED;
+	}
+
+#if KESON_ENABLE_ENCODE_CACHE
+	std::shared_ptr<const std::string> Node::cachedEncoding(uint32_t flags, uint32_t depth) const {
+		std::shared_ptr<const Encoding> encoding;
+		if (isVector() && std::get<SharedVector>(_value)->sealed()) {
+			encoding = std::atomic_load(&std::get<SharedVector>(_value)->encoding);
+		}
+		else if (isMap() && std::get<SharedMap>(_value)->sealed()) {
+			encoding = std::atomic_load(&std::get<SharedMap>(_value)->encoding);
+		}
+
+		if (encoding == nullptr || encoding->flags != flags || encoding->depth != depth) {
+			return nullptr;
+		}
+		return std::shared_ptr<const std::string>(encoding, &encoding->bytes);
+	}
+
+	void Node::setCachedEncoding(uint32_t flags, uint32_t depth, std::string bytes) const {
+		// Output of an exposed container could be changed behind its back, so it is not kept
+		if (!cachesEncoding()) {
+			return;
+		}
+		auto encoding = std::make_shared<const Encoding>(Encoding{ flags, depth, std::move(bytes) });
+		if (isVector()) {
+			std::atomic_store(&std::get<SharedVector>(_value)->encoding, std::move(encoding));
+		}
+		else {
+			std::atomic_store(&std::get<SharedMap>(_value)->encoding, std::move(encoding));
+		}
+	}
+
+	bool Node::cachesEncoding() const {
+		return (isVector() && std::get<SharedVector>(_value)->sealed())
+			|| (isMap() && std::get<SharedMap>(_value)->sealed());
+	}
+#endif
+
+	template<typename T>
+	bool Node::knownDifferent(const Box<T>& a, const Box<T>& b) {
+#if KESON_ENABLE_HASH_CACHE
+		uint64_t ha = a.cachedHash();
+		uint64_t hb = b.cachedHash();
+		return ha != 0 && hb != 0 && ha != hb;
+#else
+		(void)a;
+		(void)b;
+		return false;
+#endif
+	}
+
+	// Element i of a packed array or vector as an atom, or nullopt for a container
+	static std::optional<std::string_view> elementAtom(const Node& node, size_t i, char* buffer) {
+		if (node.isPacked()) {
+			return formatPacked(node.packed(), i, buffer);
+		}
+		const Node& child = node.vector()[i];
+		if (!child.isAtom()) {
+			return std::nullopt;
+		}
+		return std::string_view(child.atom());
+	}
+
+	bool Node::operator==(const Node& other) const {
+		if (isPacked() || other.isPacked()) {
+			if (!(isVector() || isPacked()) || !(other.isVector() || other.isPacked())) { return false; }
+			if (_value == other._value) { return true; }
+			size_t size = length();
+			if (size != other.length()) { return false; }
+			char a[PACKED_BUFFER_SIZE];
+			char b[PACKED_BUFFER_SIZE];
+			for (size_t i = 0; i < size; i++) {
+				auto x = elementAtom(*this, i, a);
+				auto y = elementAtom(other, i, b);
+				if (!x || !y || *x != *y) {
+					return false;
+				}
+			}
+			return true;
+		}
+		else if (_value.index() != other._value.index()) {
+			return false;
+		}
+		else if (isAtom()) {
+			return atom() == other.atom();
+		}
+		else if (isVector()) {
+			auto& a = std::get<SharedVector>(_value);
+			auto& b = std::get<SharedVector>(other._value);
+			if (a == b) { return true; }
+			if (knownDifferent(*a, *b)) { return false; }
+			return a->value == b->value;
+		}
+		else if (isMap()) {
+			auto& a = std::get<SharedMap>(_value);
+			auto& b = std::get<SharedMap>(other._value);
+			if (a == b) { return true; }
+			if (knownDifferent(*a, *b)) { return false; }
+			size_t count = 0;
+			for (auto& keyChild : a->value) {
+				if (keyChild.second.isNull()) { continue; }
+				const Node* match = other.find(keyChild.first);
+				if (match == nullptr || *match != keyChild.second) {
+					return false;
+				}
+				count += 1;
+			}
+			for (auto& keyChild : b->value) {
+				count -= !keyChild.second.isNull();
+			}
+			return count == 0;
+		}
+		return true;
+	}
+
+	bool Node::operator!=(const Node& other) const {
+		return !(*this == other);
+	}
+
+	const Node::Atom& Node::atom() const {
+		return std::get<Atom>(_value);
+	}
+
+	Node::Atom& Node::atom() {
+		if (isNull()) { _value = Atom(); }
+		return std::get<Atom>(_value);
+	}
+
+	std::string Node::value_or(std::string fallback) const   { return !isAtom() ? fallback : atom(); }
+    int8_t      Node::value_or(int8_t fallback) const        { return !isAtom() ? fallback : (int8_t)(*this); }
+    uint8_t     Node::value_or(uint8_t fallback) const       { return !isAtom() ? fallback : (uint8_t)(*this); }
+    int16_t     Node::value_or(int16_t fallback) const       { return !isAtom() ? fallback : (int16_t)(*this); }
+    uint16_t    Node::value_or(uint16_t fallback) const      { return !isAtom() ? fallback : (uint16_t)(*this); }
+    int32_t     Node::value_or(int32_t fallback) const       { return !isAtom() ? fallback : (int32_t)(*this); }
+    uint32_t    Node::value_or(uint32_t fallback) const      { return !isAtom() ? fallback : (uint32_t)(*this); }
+    int64_t     Node::value_or(int64_t fallback) const       { return !isAtom() ? fallback : (int64_t)(*this); }
+    uint64_t    Node::value_or(uint64_t fallback) const      { return !isAtom() ? fallback : (uint64_t)(*this); }
+    float       Node::value_or(float fallback) const         { return !isAtom() ? fallback : (float)(*this); }
+    double      Node::value_or(double fallback) const        { return !isAtom() ? fallback : (double)(*this); }
+    bool        Node::value_or(bool fallback) const          { return !isAtom() ? fallback : (bool)(*this); }
+#if KESON_ENABLE_WSTRING
+	std::wstring Node::value_or(std::wstring fallback) const { return !isAtom() ? fallback : from_utf8(atom()); }
+#endif
+
+	template<typename T>
+	std::optional<T> Node::try_get() const {
+		if (!isAtom()) { return std::nullopt; }
+		return try_from_string<T>(atom());
+	}
+
+	template std::optional<int8_t>   Node::try_get<int8_t>() const;
+	template std::optional<uint8_t>  Node::try_get<uint8_t>() const;
+	template std::optional<int16_t>  Node::try_get<int16_t>() const;
+	template std::optional<uint16_t> Node::try_get<uint16_t>() const;
+	template std::optional<int32_t>  Node::try_get<int32_t>() const;
+	template std::optional<uint32_t> Node::try_get<uint32_t>() const;
+	template std::optional<int64_t>  Node::try_get<int64_t>() const;
+	template std::optional<uint64_t> Node::try_get<uint64_t>() const;
+	template std::optional<float>    Node::try_get<float>() const;
+	template std::optional<double>   Node::try_get<double>() const;
+	template std::optional<bool>     Node::try_get<bool>() const;
+
+	Node::operator std::string() const                       { return atom(); }
+	Node::operator int8_t() const                            { return from_string<int8_t>(atom());   }
+	Node::operator uint8_t() const                           { return from_string<uint8_t>(atom());  }
+	Node::operator int16_t() const                           { return from_string<int16_t>(atom());  }
+	Node::operator uint16_t() const                          { return from_string<uint16_t>(atom()); }
+	Node::operator int32_t() const                           { return from_string<int32_t>(atom());  }
+	Node::operator uint32_t() const                          { return from_string<uint32_t>(atom()); }
+	Node::operator int64_t() const                           { return from_string<int64_t>(atom());  }
+	Node::operator uint64_t() const                          { return from_string<uint64_t>(atom()); }
+	Node::operator float() const                             { return from_string<float>(atom());    }
+	Node::operator double() const                            { return from_string<double>(atom());   }
+	Node::operator bool() const                              { return from_string<bool>(atom());     }
+#if KESON_ENABLE_WSTRING
+	Node::operator std::wstring() const                      { return from_utf8(atom()); }
+#endif
+
+	void Node::operator=(std::string value)                  { _value = std::move(value); }
+	void Node::operator=(const char* value)                  { _value = std::string(value); }
+	void Node::operator=(int8_t value)                       { _value = to_string(value); }
+	void Node::operator=(uint8_t value)                      { _value = to_string(value); }
+	void Node::operator=(int16_t value)                      { _value = to_string(value); }
+	void Node::operator=(uint16_t value)                     { _value = to_string(value); }
+	void Node::operator=(int32_t value)                      { _value = to_string(value); }
+	void Node::operator=(uint32_t value)                     { _value = to_string(value); }
+	void Node::operator=(int64_t value)                      { _value = to_string(value); }
+	void Node::operator=(uint64_t value)                     { _value = to_string(value); }
+	void Node::operator=(float value)                        { _value = to_string(value); }
+	void Node::operator=(double value)                       { _value = to_string(value); }
+	void Node::operator=(bool value)                         { _value = to_string(value); }
+#if KESON_ENABLE_WSTRING
+	void Node::operator=(const std::wstring& value)          { _value = to_utf8(value); }
+	void Node::operator=(const wchar_t* value)               { _value = to_utf8(value); }
+#endif
+
+	const Node::Vector& Node::vector() const {
+		if (isPacked()) {
+			return packedElements();
+		}
+		return std::get<SharedVector>(_value)->value;
+	}
+
+	const Node::Vector& Node::packedElements() const {
+		auto& box = *std::get<SharedPacked>(_value);
+		auto elements = std::atomic_load(&box.elements);
+		if (elements == nullptr) {
+			auto made = std::make_shared<Vector>();
+			made->reserve(packedSize(box.value));
+			std::visit([&](auto& values) {
+				for (auto value : values) {
+					made->emplace_back(value);
+				}
+			}, box.value);
+
+			// Another thread may have made them first
+			std::shared_ptr<const Vector> expected;
+			elements = std::atomic_compare_exchange_strong(&box.elements, &expected, std::shared_ptr<const Vector>(made)) ? made : expected;
+		}
+		return *elements;
+	}
+
+	Node::Vector& Node::vector() {
+		if (isNull()) { _value = std::make_shared<Box<Vector>>(); }
+		if (isPacked()) {
+			auto& p = packed();
+			Vector v;
+			v.reserve(packedSize(p));
+			std::visit([&](auto& values) {
+				for (auto value : values) {
+					v.emplace_back(value);
+				}
+			}, p);
+			_value = std::make_shared<Box<Vector>>(std::move(v));
+		}
+		auto& shared = std::get<SharedVector>(_value);
+		if (shared.use_count() > 1) {
+			Vector v;
+			v.reserve(shared->value.size());
+			for (auto& child : shared->value) {
+				v.push_back(child.snapshot());
+			}
+			shared = std::make_shared<Box<Vector>>(std::move(v));
+		}
+		shared->invalidate();
+		return shared->value;
+	}
+
+	size_t Node::length() const {
+		if (isVector()) {
+			return vector().size();
+		}
+		else if (isPacked()) {
+			return packedSize(packed());
+		}
+		else if (isNull()) {
+			return 0;
+		}
+		else {
+			return 1;
+		}
+	}
+
+	const Node* Node::begin() const {
+		if (isVector() || isPacked()) {
+			return vector().data();
+		}
+		else if (isNull()) {
+			return nullptr;
+		}
+		else {
+			return this;
+		}
+	}
+
+	Node* Node::begin() {
+		if (isVector() || isPacked()) {
+			return vector().data();
+		}
+		else if (isNull()) {
+			return nullptr;
+		}
+		else {
+			return this;
+		}
+	}
+
+	const Node* Node::end() const {
+		if (isVector() || isPacked()) {
+			return vector().data() + vector().size();
+		}
+		else if (isNull()) {
+			return nullptr;
+		}
+		else {
+			return this + 1;
+		}
+	}
+
+	Node* Node::end() {
+		if (isVector() || isPacked()) {
+			return vector().data() + vector().size();
+		}
+		else if (isNull()) {
+			return nullptr;
+		}
+		else {
+			return this + 1;
+		}
+	}
+
+	Node& Node::operator[](size_t pos) {
+		if (vector().size() <= pos) {
+			vector().resize(pos + 1);
+		}
+		return vector()[pos];
+	}
+
+	const Node& Node::operator[](size_t pos) const {
+		return vector().at(pos);
+	}
+
+	void Node::push_back(Node node) {
+		vector().emplace_back(std::move(node));
+	}
+
+	Node& Node::push_back() {
+		vector().emplace_back(Node());
+		return vector().back();
+	}
+
+	template<typename T>
+	static const std::vector<T>* packedAs(const Node::Packed& packed) {
+		if constexpr (std::is_same_v<T, int32_t> || std::is_same_v<T, int64_t> || std::is_same_v<T, float> || std::is_same_v<T, double>) {
+			return std::get_if<std::vector<T>>(&packed);
+		}
+		else {
+			return nullptr;
+		}
+	}
+
+	template<typename T>
+	size_t Node::copy_to(T* out, size_t count) const {
+		if (isPacked()) {
+			auto& p = packed();
+			size_t n = std::min(count, packedSize(p));
+			if (auto same = packedAs<T>(p)) {
+				std::copy(same->begin(), same->begin() + n, out);
+				return n;
+			}
+			char buffer[PACKED_BUFFER_SIZE];
+			for (size_t i = 0; i < n; i++) {
+				auto value = try_from_string<T>(formatPacked(p, i, buffer));
+				if (!value) {
+					return i;
+				}
+				out[i] = *value;
+			}
+			return n;
+		}
+
+		const Node* elements = begin();
+		size_t n = std::min(count, length());
+		for (size_t i = 0; i < n; i++) {
+			const Atom* atom = std::get_if<Atom>(&elements[i]._value);
+			std::optional<T> value;
+			if (atom == nullptr || !(value = try_from_string<T>(*atom))) {
+				return i;
+			}
+			out[i] = *value;
+		}
+		return n;
+	}
+
+	template size_t Node::copy_to<int8_t>(int8_t* out, size_t count) const;
+	template size_t Node::copy_to<uint8_t>(uint8_t* out, size_t count) const;
+	template size_t Node::copy_to<int16_t>(int16_t* out, size_t count) const;
+	template size_t Node::copy_to<uint16_t>(uint16_t* out, size_t count) const;
+	template size_t Node::copy_to<int32_t>(int32_t* out, size_t count) const;
+	template size_t Node::copy_to<uint32_t>(uint32_t* out, size_t count) const;
+	template size_t Node::copy_to<int64_t>(int64_t* out, size_t count) const;
+	template size_t Node::copy_to<uint64_t>(uint64_t* out, size_t count) const;
+	template size_t Node::copy_to<float>(float* out, size_t count) const;
+	template size_t Node::copy_to<double>(double* out, size_t count) const;
+
+	const Node::Packed& Node::packed() const {
+		return std::get<SharedPacked>(_value)->value;
+	}
+
+	Node::Packed& Node::packed() {
+		auto& shared = std::get<SharedPacked>(_value);
+		if (shared.use_count() > 1) {
+			shared = std::make_shared<Box<Packed>>(*shared);
+		}
+		shared->invalidate();
+		return shared->value;
+	}
+
+	const Node::Map& Node::map() const {
+		return std::get<SharedMap>(_value)->value;
+	}
+
+	Node::Map& Node::map() {
+		if (isNull()) { _value = std::make_shared<Box<Map>>(); }
+		auto& shared = std::get<SharedMap>(_value);
+		if (shared.use_count() > 1) {
+			shared = std::make_shared<Box<Map>>(shared->value.copyWith([](const Node& child) { return child.snapshot(); }));
+		}
+		shared->invalidate();
+		return shared->value;
+	}
+
+	const Node& Node::operator[](const std::string& key) const {
+		return (*this)[std::string_view(key)];
+	}
+
+	Node& Node::operator[](const std::string& key) {
+		return map()[std::string_view(key)];
+	}
+
+	Node& Node::operator[](const char* key) {
+		return (*this)[std::string_view(key)];
+	}
+
+	const Node& Node::operator[](const char* key) const {
+		return (*this)[std::string_view(key)];
+	}
+
+	Node& Node::operator[](std::string_view key) {
+		return map()[key];
+	}
+
+	const Node& Node::operator[](std::string_view key) const {
+		const Node* node = find(key);
+		return node != nullptr ? *node : Node::NULL_NODE;
+	}
+
+	Node& Node::operator[](const Key& key) {
+		return map()[key];
+	}
+
+	const Node& Node::operator[](const Key& key) const {
+		const Node* node = find(key);
+		return node != nullptr ? *node : Node::NULL_NODE;
+	}
+
+	Node* Node::find(std::string_view key) {
+		if (isMap()) {
+			auto& v = map();
+			auto it = v.find(key);
+			if (it != v.end()) {
+				return &it->second;
+			}
+		}
+		return nullptr;
+	}
+
+	const Node* Node::find(std::string_view key) const {
+		if (isMap()) {
+			auto& v = map();
+			auto it = v.find(key);
+			if (it != v.end()) {
+				return &it->second;
+			}
+		}
+		return nullptr;
+	}
+
+	Node* Node::find(const Key& key) {
+		if (isMap()) {
+			auto& v = map();
+			auto it = v.find(key);
+			if (it != v.end()) {
+				return &it->second;
+			}
+		}
+		return nullptr;
+	}
+
+	const Node* Node::find(const Key& key) const {
+		if (isMap()) {
+			auto& v = map();
+			auto it = v.find(key);
+			if (it != v.end()) {
+				return &it->second;
+			}
+		}
+		return nullptr;
+	}
+
+	void swap(Node& a, Node& b) {
+		std::swap(a._value, b._value);
+	}
+}
+
+void std::swap(keson::Node& a, keson::Node& b) {
+	keson::swap(a, b);
+}
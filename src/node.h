@@ -1,144 +1,344 @@
-#pragma once
-
-#include <string>
-#include <vector>
-#include <cstdint>
-#include <unordered_map>
-#include <variant>
-
-#include "conf.h"
-
-namespace keson
-{
-    class Node {
-    public:
-        using Null   = std::monostate;
-        using Atom   = std::string;
-        using Vector = std::vector<Node>;
-        using Map    = std::unordered_map<std::string, Node>;
-
-        Node();
-        Node(std::string         value);
-        Node(const char*         value);
-        Node(Vector              value);
-        Node(Map                 value);
-        Node(int8_t              value);
-        Node(uint8_t             value);
-        Node(int16_t             value);
-        Node(uint16_t            value);
-        Node(int32_t             value);
-        Node(uint32_t            value);
-        Node(int64_t             value);
-        Node(uint64_t            value);
-        Node(float               value);
-        Node(double              value);
-        Node(bool                value);
-#if KESON_ENABLE_WSTRING
-        Node(const std::wstring& value);
-        Node(const wchar_t*      value);
-#endif
-
-        bool isNull() const;
-        bool isAtom() const;
-        bool isVector() const;
-        bool isMap() const;
-
-        //////////
-        // Atom //
-        //////////
-
-        const Atom& atom() const;
-        Atom& atom();
-
-        std::string value_or(std::string   fallback) const;
-        int8_t      value_or(int8_t        fallback) const;
-        uint8_t     value_or(uint8_t       fallback) const;
-        int16_t     value_or(int16_t       fallback) const;
-        uint16_t    value_or(uint16_t      fallback) const;
-        int32_t     value_or(int32_t       fallback) const;
-        uint32_t    value_or(uint32_t      fallback) const;
-        int64_t     value_or(int64_t       fallback) const;
-        uint64_t    value_or(uint64_t      fallback) const;
-        float       value_or(float         fallback) const;
-        double      value_or(double        fallback) const;
-        bool        value_or(bool          fallback) const;
-#if KESON_ENABLE_WSTRING
-        std::wstring value_or(std::wstring fallback) const;
-#endif
-
-        operator std::string() const;
-        operator int8_t() const;
-        operator uint8_t() const;
-        operator int16_t() const;
-        operator uint16_t() const;
-        operator int32_t() const;
-        operator uint32_t() const;
-        operator int64_t() const;
-        operator uint64_t() const;
-        operator float() const;
-        operator double() const;
-        operator bool() const;
-#if KESON_ENABLE_WSTRING
-        operator std::wstring() const;
-#endif
-
-        void operator=(std::string         value);
-        void operator=(const char*         value);
-        void operator=(int8_t              value);
-        void operator=(uint8_t             value);
-        void operator=(int16_t             value);
-        void operator=(uint16_t            value);
-        void operator=(int32_t             value);
-        void operator=(uint32_t            value);
-        void operator=(int64_t             value);
-        void operator=(uint64_t            value);
-        void operator=(float               value);
-        void operator=(double              value);
-        void operator=(bool                value);
-#if KESON_ENABLE_WSTRING
-        void operator=(const std::wstring& value);
-        void operator=(const wchar_t*      value);
-#endif
-
-        ////////////
-        // Vector //
-        ////////////
-
-        const Vector& vector() const;
-        Vector& vector();
-
-        size_t length() const;
-
-        const Node* begin() const;
-        Node* begin();
-
-        const Node* end() const;
-        Node* end();
-
-        Node& operator[](size_t pos);
-        const Node& operator[](size_t pos) const;
-
-        void push_back(Node node);
-        Node& push_back();
-
-        /////////
-        // Map //
-        /////////
-
-        const Map& map() const;
-        Map& map();
-
-        Node& operator[](const std::string& key);
-        const Node& operator[](const std::string& key) const;
-        Node& operator[](const char* key);
-        const Node& operator[](const char* key) const;
-
-    private:
-        friend void swap(Node& a, Node& b);
-
-        static const Node NULL_NODE;
-        std::variant<Null, Atom, Vector, Map> _value;
-    };
-}
-
-namespace std { void swap(keson::Node& a, keson::Node& b); }
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <variant>
+#include <memory>
+#include <atomic>
+#include <optional>
+#include <type_traits>
+
+#include "conf.h"
+#include "flatmap.h"
+#include "key.h"
+
+namespace keson
+{
+    class Node {
+    public:
+        using Null   = std::monostate;
+        using Atom   = std::string;
+        using Vector = std::vector<Node>;
+        using Map    = FlatMap<Node>;
+        using Packed = std::variant<std::vector<int32_t>, std::vector<int64_t>, std::vector<float>, std::vector<double>>;
+
+        Node();
+        Node(const Node&         other);
+        Node(Node&&              other) noexcept;
+        Node(std::string         value);
+        Node(const char*         value);
+        Node(Vector              value);
+        Node(Map                 value);
+        Node(std::vector<int32_t> value);
+        Node(std::vector<int64_t> value);
+        Node(std::vector<float>  value);
+        Node(std::vector<double> value);
+        Node(int8_t              value);
+        Node(uint8_t             value);
+        Node(int16_t             value);
+        Node(uint16_t            value);
+        Node(int32_t             value);
+        Node(uint32_t            value);
+        Node(int64_t             value);
+        Node(uint64_t            value);
+        Node(float               value);
+        Node(double              value);
+        Node(bool                value);
+#if KESON_ENABLE_WSTRING
+        Node(const std::wstring& value);
+        Node(const wchar_t*      value);
+#endif
+
+        Node& operator=(const Node& other);
+        Node& operator=(Node&& other) noexcept;
+
+        // Copying a Node copies the whole tree. A snapshot instead shares every vector
+        // and map with this node in O(1). Shared containers are immutable: whichever
+        // node is written to first clones the containers on the path to the write
+        // through its mutable accessors, leaving the other untouched.
+        //
+        // References into this node taken before the snapshot are not tracked and
+        // would write into the shared tree, so acquire them again afterwards. That is
+        // also what lets the caches described at hash() trust this tree again.
+        Node snapshot() const;
+
+        bool isNull() const;
+        bool isAtom() const;
+        bool isVector() const;
+        bool isMap() const;
+        bool isPacked() const;
+
+        // Structural hash of the whole tree. Map entries are combined independently of
+        // their order. Like encode, null map values are treated as absent, both here and
+        // in the comparison operators.
+        //
+        // With KESON_ENABLE_HASH_CACHE the hash of each vector and map is remembered,
+        // but only while the container is sealed. Any mutable accessor unseals it,
+        // since the references it hands out can be written through at any later time
+        // without the container or its parents knowing. snapshot() seals the tree
+        // again. A tree that is built or edited and then hashed without a snapshot
+        // is therefore always hashed in full, and never answers from a stale cache.
+        uint64_t hash() const;
+
+        // Deep comparison. Cached hashes let unequal subtrees be rejected early.
+        bool operator==(const Node& other) const;
+        bool operator!=(const Node& other) const;
+
+#if KESON_ENABLE_ENCODE_CACHE
+        // Output of encode for this vector or map as last written with flags at the
+        // given depth, or nullptr if there is none. encode keeps it up to date. Like
+        // the hash, it is only kept while the container is sealed, see hash().
+        std::shared_ptr<const std::string> cachedEncoding(uint32_t flags, uint32_t depth) const;
+        void setCachedEncoding(uint32_t flags, uint32_t depth, std::string encoding) const;
+        // Whether setCachedEncoding would keep the encoding, so encode can skip
+        // copying output it would throw away
+        bool cachesEncoding() const;
+#endif
+
+        //////////
+        // Atom //
+        //////////
+
+        const Atom& atom() const;
+        Atom& atom();
+
+        std::string value_or(std::string   fallback) const;
+        int8_t      value_or(int8_t        fallback) const;
+        uint8_t     value_or(uint8_t       fallback) const;
+        int16_t     value_or(int16_t       fallback) const;
+        uint16_t    value_or(uint16_t      fallback) const;
+        int32_t     value_or(int32_t       fallback) const;
+        uint32_t    value_or(uint32_t      fallback) const;
+        int64_t     value_or(int64_t       fallback) const;
+        uint64_t    value_or(uint64_t      fallback) const;
+        float       value_or(float         fallback) const;
+        double      value_or(double        fallback) const;
+        bool        value_or(bool          fallback) const;
+#if KESON_ENABLE_WSTRING
+        std::wstring value_or(std::wstring fallback) const;
+#endif
+
+        // Parses the atom as an integer, float or bool without allocating. Returns nullopt
+        // if this is not an atom or the atom is not entirely a valid, in-range T, so
+        // untrusted input can be checked instead of asserted on. Integers may be written
+        // with a 0x, 0o or 0b prefix.
+        template<typename T> std::optional<T> try_get() const;
+
+        operator std::string() const;
+        operator int8_t() const;
+        operator uint8_t() const;
+        operator int16_t() const;
+        operator uint16_t() const;
+        operator int32_t() const;
+        operator uint32_t() const;
+        operator int64_t() const;
+        operator uint64_t() const;
+        operator float() const;
+        operator double() const;
+        operator bool() const;
+#if KESON_ENABLE_WSTRING
+        operator std::wstring() const;
+#endif
+
+        void operator=(std::string         value);
+        void operator=(const char*         value);
+        void operator=(int8_t              value);
+        void operator=(uint8_t             value);
+        void operator=(int16_t             value);
+        void operator=(uint16_t            value);
+        void operator=(int32_t             value);
+        void operator=(uint32_t            value);
+        void operator=(int64_t             value);
+        void operator=(uint64_t            value);
+        void operator=(float               value);
+        void operator=(double              value);
+        void operator=(bool                value);
+#if KESON_ENABLE_WSTRING
+        void operator=(const std::wstring& value);
+        void operator=(const wchar_t*      value);
+#endif
+
+        ////////////
+        // Vector //
+        ////////////
+
+        const Vector& vector() const;
+        Vector& vector();
+
+        size_t length() const;
+
+        const Node* begin() const;
+        Node* begin();
+
+        const Node* end() const;
+        Node* end();
+
+        Node& operator[](size_t pos);
+        const Node& operator[](size_t pos) const;
+
+        void push_back(Node node);
+        Node& push_back();
+
+        // Converts up to count elements to T into out in one pass, without going through
+        // the conversion operators. Returns the number of elements written. Conversion
+        // stops at the first element that is not an atom holding a valid, in-range T, so
+        // a result below min(length(), count) is the index of that element.
+        template<typename T> size_t copy_to(T* out, size_t count) const;
+
+        ////////////
+        // Packed //
+        ////////////
+
+        // A packed array is a vector of numbers stored as one std::vector of int32_t,
+        // int64_t, float or double instead of a Node per element. It hashes and compares
+        // like the vector of atoms the numbers would format to, and length() and copy_to
+        // work on it directly. encode writes it as a vector of numbers, which are quoted
+        // with Flag_QUOTE_NUMERIC_VALUES, and also with Flag_QUOTE_STRING_VALUES like
+        // the atoms would be.
+        //
+        // isVector() is false for a packed array, but the const vector accessors still
+        // work on it: vector(), begin(), end() and operator[] see element Nodes that are
+        // made on first use and kept until the array is next accessed mutably. The
+        // mutable vector accessors, including operator[] and push_back, convert it into
+        // a normal vector first.
+        const Packed& packed() const;
+        Packed& packed();
+
+        /////////
+        // Map //
+        /////////
+
+        const Map& map() const;
+        Map& map();
+
+        Node& operator[](const std::string& key);
+        const Node& operator[](const std::string& key) const;
+        Node& operator[](const char* key);
+        const Node& operator[](const char* key) const;
+        Node& operator[](std::string_view key);
+        const Node& operator[](std::string_view key) const;
+        Node& operator[](const Key& key);
+        const Node& operator[](const Key& key) const;
+
+        // Returns nullptr if this is not a map or has no such key. Never allocates.
+        Node* find(std::string_view key);
+        const Node* find(std::string_view key) const;
+        Node* find(const Key& key);
+        const Node* find(const Key& key) const;
+
+    private:
+        friend void swap(Node& a, Node& b);
+        friend class MemoryCounter;
+
+#if KESON_ENABLE_ENCODE_CACHE
+        struct Encoding {
+            uint32_t flags;
+            uint32_t depth;
+            std::string bytes;
+        };
+#endif
+
+        struct NoElements {};
+
+        struct PackedElements {
+            // Accessed atomically, null until made by packedElements()
+            mutable std::shared_ptr<const Vector> elements;
+        };
+
+        // Vectors, maps and packed arrays live in reference counted boxes so that
+        // snapshots can share them. A box also caches values derived from its
+        // contents, which the mutable accessors invalidate.
+        template<typename T>
+        struct Box : std::conditional_t<std::is_same_v<T, Packed>, PackedElements, NoElements> {
+            Box() {}
+
+            explicit Box(T value) : value(std::move(value)) {}
+
+            // Nothing refers into the contents of a copy yet, so it starts out sealed
+            Box(const Box& other) : value(other.value) {
+#if KESON_ENABLE_HASH_CACHE || KESON_ENABLE_ENCODE_CACHE
+                exposed.store(false, std::memory_order_relaxed);
+#endif
+#if KESON_ENABLE_HASH_CACHE
+                hash.store(other.cachedHash(), std::memory_order_relaxed);
+#endif
+#if KESON_ENABLE_ENCODE_CACHE
+                if (other.sealed()) {
+                    encoding = std::atomic_load(&other.encoding);
+                }
+#endif
+            }
+
+            void invalidate() {
+                if constexpr (std::is_same_v<T, Packed>) {
+                    std::atomic_store(&this->elements, std::shared_ptr<const Vector>());
+                }
+#if KESON_ENABLE_HASH_CACHE || KESON_ENABLE_ENCODE_CACHE
+                exposed.store(true, std::memory_order_relaxed);
+#endif
+#if KESON_ENABLE_HASH_CACHE
+                hash.store(0, std::memory_order_relaxed);
+#endif
+#if KESON_ENABLE_ENCODE_CACHE
+                std::atomic_store(&encoding, std::shared_ptr<const Encoding>());
+#endif
+            }
+
+#if KESON_ENABLE_HASH_CACHE || KESON_ENABLE_ENCODE_CACHE
+            bool sealed() const {
+                return !exposed.load(std::memory_order_relaxed);
+            }
+#endif
+
+#if KESON_ENABLE_HASH_CACHE
+            uint64_t cachedHash() const {
+                return sealed() ? hash.load(std::memory_order_relaxed) : 0;
+            }
+
+            void cacheHash(uint64_t h) const {
+                if (sealed()) {
+                    hash.store(h, std::memory_order_relaxed);
+                }
+            }
+#endif
+
+            T value;
+#if KESON_ENABLE_HASH_CACHE || KESON_ENABLE_ENCODE_CACHE
+            // Set when a mutable accessor may have handed out references into value,
+            // cleared by seal(). Boxes made from a container the caller passed in
+            // may be referenced already, so they start out exposed.
+            mutable std::atomic<bool> exposed { true };
+#endif
+#if KESON_ENABLE_HASH_CACHE
+            // Zero until computed
+            mutable std::atomic<uint64_t> hash { 0 };
+#endif
+#if KESON_ENABLE_ENCODE_CACHE
+            // Accessed atomically, null until encoded
+            mutable std::shared_ptr<const Encoding> encoding;
+#endif
+        };
+
+        using SharedVector = std::shared_ptr<Box<Vector>>;
+        using SharedMap    = std::shared_ptr<Box<Map>>;
+        using SharedPacked = std::shared_ptr<Box<Packed>>;
+
+        const Vector& packedElements() const;
+
+#if KESON_ENABLE_HASH_CACHE || KESON_ENABLE_ENCODE_CACHE
+        // Seals every exposed box in the tree. Sealed boxes only have sealed boxes
+        // below them, so this visits just the part accessed mutably since.
+        void seal() const;
+#endif
+
+        template<typename T>
+        static bool knownDifferent(const Box<T>& a, const Box<T>& b);
+
+        static const Node NULL_NODE;
+        std::variant<Null, Atom, SharedVector, SharedMap, SharedPacked> _value;
+    };
+}
+
+namespace std { void swap(keson::Node& a, keson::Node& b); }
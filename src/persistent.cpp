@@ -0,0 +1,508 @@
+#include "persistent.h"
+
+#include <algorithm>
+#include <iterator>
+#include <cassert>
+
+namespace keson
+{
+    struct PersistentNode::Data {
+        explicit Data(Kind kind) : kind(kind) {}
+
+        Kind kind;
+    };
+
+    struct PersistentNode::Impl {
+        static constexpr unsigned BITS = 5;
+        static constexpr size_t WIDTH = (size_t)1 << BITS;
+        static constexpr size_t MASK = WIDTH - 1;
+
+        // Map branches at or below this shift have run out of hash bits and hold a plain
+        // list of colliding entries.
+        static constexpr unsigned MAX_SHIFT = 64;
+
+        struct AtomData : Data {
+            AtomData(std::string value) : Data(Kind_ATOM), value(std::move(value)) {}
+
+            std::string value;
+        };
+
+        // Leaf chunks hold up to WIDTH items, inner chunks up to WIDTH children. Every
+        // chunk except those on the rightmost path is full.
+        struct VectorChunk {
+            std::vector<PersistentNode> items;
+            std::vector<std::shared_ptr<const VectorChunk>> children;
+        };
+
+        struct VectorData : Data {
+            VectorData() : Data(Kind_VECTOR) {}
+
+            size_t size = 0;
+            unsigned shift = 0;
+            std::shared_ptr<const VectorChunk> root;
+        };
+
+        struct MapEntry {
+            std::string key;
+            uint64_t hash;
+            uint64_t seq;
+            PersistentNode value;
+        };
+
+        // Entries stored directly in a branch and sub-branches are indexed by separate
+        // bitmaps, each compacted in bit order.
+        struct MapBranch {
+            uint32_t entryMap = 0;
+            uint32_t branchMap = 0;
+            std::vector<MapEntry> entries;
+            std::vector<std::shared_ptr<const MapBranch>> branches;
+        };
+
+        struct MapData : Data {
+            MapData() : Data(Kind_MAP) {}
+
+            size_t size = 0;
+            uint64_t nextSeq = 0;
+            std::shared_ptr<const MapBranch> root;
+        };
+
+        using ChunkPtr = std::shared_ptr<const VectorChunk>;
+        using BranchPtr = std::shared_ptr<const MapBranch>;
+
+        static const AtomData& atom(const PersistentNode& n)     { return static_cast<const AtomData&>(*n._data); }
+        static const VectorData& vector(const PersistentNode& n) { return static_cast<const VectorData&>(*n._data); }
+        static const MapData& map(const PersistentNode& n)       { return static_cast<const MapData&>(*n._data); }
+
+        static unsigned popcount(uint32_t v) {
+            v = v - ((v >> 1) & 0x55555555);
+            v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+            return (((v + (v >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24;
+        }
+
+        static uint32_t bitOf(uint64_t hash, unsigned shift) {
+            return 1u << ((hash >> shift) & MASK);
+        }
+
+        static size_t indexOf(uint32_t bitmap, uint32_t bit) {
+            return popcount(bitmap & (bit - 1));
+        }
+
+        ////////////
+        // Vector //
+        ////////////
+
+        static PersistentNode buildVector(std::vector<PersistentNode> items) {
+            auto data = std::make_shared<VectorData>();
+            data->size = items.size();
+
+            std::vector<ChunkPtr> level;
+            for (size_t i = 0; i < items.size(); i += WIDTH) {
+                auto chunk = std::make_shared<VectorChunk>();
+                auto first = items.begin() + i;
+                auto last = items.begin() + std::min(i + WIDTH, items.size());
+                chunk->items.assign(std::make_move_iterator(first), std::make_move_iterator(last));
+                level.push_back(std::move(chunk));
+            }
+
+            while (level.size() > 1) {
+                std::vector<ChunkPtr> parents;
+                for (size_t i = 0; i < level.size(); i += WIDTH) {
+                    auto chunk = std::make_shared<VectorChunk>();
+                    auto first = level.begin() + i;
+                    auto last = level.begin() + std::min(i + WIDTH, level.size());
+                    chunk->children.assign(first, last);
+                    parents.push_back(std::move(chunk));
+                }
+                level = std::move(parents);
+                data->shift += BITS;
+            }
+
+            if (!level.empty()) {
+                data->root = std::move(level[0]);
+            }
+            return PersistentNode(std::move(data));
+        }
+
+        static const PersistentNode& vectorAt(const VectorData& v, size_t pos) {
+            const VectorChunk* chunk = v.root.get();
+            for (unsigned level = v.shift; level > 0; level -= BITS) {
+                chunk = chunk->children[(pos >> level) & MASK].get();
+            }
+            return chunk->items[pos & MASK];
+        }
+
+        static ChunkPtr vectorSet(const ChunkPtr& chunk, unsigned level, size_t pos, PersistentNode value) {
+            auto copy = std::make_shared<VectorChunk>(*chunk);
+            if (level == 0) {
+                copy->items[pos & MASK] = std::move(value);
+            }
+            else {
+                size_t i = (pos >> level) & MASK;
+                copy->children[i] = vectorSet(chunk->children[i], level - BITS, pos, std::move(value));
+            }
+            return copy;
+        }
+
+        // Appends at pos, which must be the current size, creating missing chunks on the way.
+        static ChunkPtr vectorAppend(const ChunkPtr& chunk, unsigned level, size_t pos, PersistentNode value) {
+            auto copy = chunk ? std::make_shared<VectorChunk>(*chunk) : std::make_shared<VectorChunk>();
+            if (level == 0) {
+                copy->items.push_back(std::move(value));
+            }
+            else {
+                size_t i = (pos >> level) & MASK;
+                if (i < copy->children.size()) {
+                    copy->children[i] = vectorAppend(copy->children[i], level - BITS, pos, std::move(value));
+                }
+                else {
+                    copy->children.push_back(vectorAppend(nullptr, level - BITS, pos, std::move(value)));
+                }
+            }
+            return copy;
+        }
+
+        static void vectorToNode(const VectorChunk& chunk, Node::Vector& out) {
+            for (auto& item : chunk.items) {
+                out.push_back(item.toNode());
+            }
+            for (auto& child : chunk.children) {
+                vectorToNode(*child, out);
+            }
+        }
+
+        /////////
+        // Map //
+        /////////
+
+        static const MapEntry* mapFind(const MapBranch* branch, std::string_view key, uint64_t hash) {
+            for (unsigned shift = 0; branch != nullptr; shift += BITS) {
+                if (shift >= MAX_SHIFT) {
+                    for (auto& e : branch->entries) {
+                        if (e.key == key) {
+                            return &e;
+                        }
+                    }
+                    return nullptr;
+                }
+
+                uint32_t bit = bitOf(hash, shift);
+                if ((branch->entryMap & bit) != 0) {
+                    auto& e = branch->entries[indexOf(branch->entryMap, bit)];
+                    return (e.hash == hash && e.key == key) ? &e : nullptr;
+                }
+                if ((branch->branchMap & bit) == 0) {
+                    return nullptr;
+                }
+                branch = branch->branches[indexOf(branch->branchMap, bit)].get();
+            }
+            return nullptr;
+        }
+
+        // Replacing an existing key keeps its original position in the insertion order.
+        static BranchPtr mapSet(const BranchPtr& branch, MapEntry entry, unsigned shift, bool& added) {
+            auto copy = branch ? std::make_shared<MapBranch>(*branch) : std::make_shared<MapBranch>();
+
+            if (shift >= MAX_SHIFT) {
+                for (auto& e : copy->entries) {
+                    if (e.key == entry.key) {
+                        entry.seq = e.seq;
+                        e = std::move(entry);
+                        added = false;
+                        return copy;
+                    }
+                }
+                copy->entries.push_back(std::move(entry));
+                added = true;
+                return copy;
+            }
+
+            uint32_t bit = bitOf(entry.hash, shift);
+            if ((copy->entryMap & bit) != 0) {
+                size_t i = indexOf(copy->entryMap, bit);
+                MapEntry& existing = copy->entries[i];
+                if (existing.hash == entry.hash && existing.key == entry.key) {
+                    entry.seq = existing.seq;
+                    existing = std::move(entry);
+                    added = false;
+                    return copy;
+                }
+
+                bool unused;
+                BranchPtr sub = mapSet(nullptr, std::move(existing), shift + BITS, unused);
+                sub = mapSet(sub, std::move(entry), shift + BITS, added);
+                copy->entries.erase(copy->entries.begin() + i);
+                copy->entryMap &= ~bit;
+                copy->branchMap |= bit;
+                copy->branches.insert(copy->branches.begin() + indexOf(copy->branchMap, bit), std::move(sub));
+                return copy;
+            }
+
+            if ((copy->branchMap & bit) != 0) {
+                size_t i = indexOf(copy->branchMap, bit);
+                copy->branches[i] = mapSet(copy->branches[i], std::move(entry), shift + BITS, added);
+                return copy;
+            }
+
+            copy->entryMap |= bit;
+            copy->entries.insert(copy->entries.begin() + indexOf(copy->entryMap, bit), std::move(entry));
+            added = true;
+            return copy;
+        }
+
+        // Returns nullptr once the branch is empty.
+        static BranchPtr mapErase(const BranchPtr& branch, std::string_view key, uint64_t hash, unsigned shift, bool& removed) {
+            removed = false;
+
+            if (shift >= MAX_SHIFT) {
+                for (size_t i = 0; i < branch->entries.size(); i++) {
+                    if (branch->entries[i].key == key) {
+                        auto copy = std::make_shared<MapBranch>(*branch);
+                        copy->entries.erase(copy->entries.begin() + i);
+                        removed = true;
+                        return isEmpty(*copy) ? nullptr : copy;
+                    }
+                }
+                return branch;
+            }
+
+            uint32_t bit = bitOf(hash, shift);
+            if ((branch->entryMap & bit) != 0) {
+                size_t i = indexOf(branch->entryMap, bit);
+                auto& e = branch->entries[i];
+                if (e.hash != hash || e.key != key) {
+                    return branch;
+                }
+                auto copy = std::make_shared<MapBranch>(*branch);
+                copy->entries.erase(copy->entries.begin() + i);
+                copy->entryMap &= ~bit;
+                removed = true;
+                return isEmpty(*copy) ? nullptr : copy;
+            }
+
+            if ((branch->branchMap & bit) != 0) {
+                size_t i = indexOf(branch->branchMap, bit);
+                BranchPtr sub = mapErase(branch->branches[i], key, hash, shift + BITS, removed);
+                if (!removed) {
+                    return branch;
+                }
+                auto copy = std::make_shared<MapBranch>(*branch);
+                if (sub && (!sub->branches.empty() || sub->entries.size() > 1)) {
+                    copy->branches[i] = std::move(sub);
+                }
+                else {
+                    copy->branches.erase(copy->branches.begin() + i);
+                    copy->branchMap &= ~bit;
+                    if (sub) {
+                        // Pull a lone remaining entry up so lookups stay short
+                        copy->entryMap |= bit;
+                        copy->entries.insert(copy->entries.begin() + indexOf(copy->entryMap, bit), sub->entries[0]);
+                    }
+                }
+                return isEmpty(*copy) ? nullptr : copy;
+            }
+
+            return branch;
+        }
+
+        static bool isEmpty(const MapBranch& branch) {
+            return branch.entries.empty() && branch.branches.empty();
+        }
+
+        static void collectEntries(const MapBranch& branch, std::vector<const MapEntry*>& out) {
+            for (auto& e : branch.entries) {
+                out.push_back(&e);
+            }
+            for (auto& sub : branch.branches) {
+                collectEntries(*sub, out);
+            }
+        }
+
+        static std::vector<const MapEntry*> orderedEntries(const MapData& m) {
+            std::vector<const MapEntry*> result;
+            result.reserve(m.size);
+            if (m.root) {
+                collectEntries(*m.root, result);
+            }
+            std::sort(result.begin(), result.end(), [](const MapEntry* a, const MapEntry* b) { return a->seq < b->seq; });
+            return result;
+        }
+    };
+
+    const PersistentNode PersistentNode::NULL_NODE;
+
+    PersistentNode::PersistentNode() {}
+    PersistentNode::PersistentNode(std::shared_ptr<const Data> data) : _data(std::move(data)) {}
+    PersistentNode::PersistentNode(std::string value)        : _data(std::make_shared<Impl::AtomData>(std::move(value))) {}
+    PersistentNode::PersistentNode(const char* value)        : PersistentNode(std::string(value)) {}
+
+    PersistentNode::PersistentNode(const Node& node) {
+        if (node.isAtom()) {
+            _data = std::make_shared<Impl::AtomData>(node.atom());
+        }
+        else if (node.isVector()) {
+            std::vector<PersistentNode> items;
+            items.reserve(node.vector().size());
+            for (auto& child : node) {
+                items.emplace_back(child);
+            }
+            *this = Impl::buildVector(std::move(items));
+        }
+        else if (node.isPacked()) {
+            Node unpacked = node;
+            unpacked.vector();
+            *this = PersistentNode(unpacked);
+        }
+        else if (node.isMap()) {
+            PersistentNode result(std::make_shared<Impl::MapData>());
+            for (auto& keyChild : node.map()) {
+                result = result.set(keyChild.first, PersistentNode(keyChild.second));
+            }
+            *this = std::move(result);
+        }
+    }
+
+    Node PersistentNode::toNode() const {
+        if (isAtom()) {
+            return Node(atom());
+        }
+        else if (isVector()) {
+            auto& v = Impl::vector(*this);
+            Node::Vector result;
+            result.reserve(v.size);
+            if (v.root) {
+                Impl::vectorToNode(*v.root, result);
+            }
+            return Node(std::move(result));
+        }
+        else if (isMap()) {
+            Node result = Node::Map();
+            for (auto* e : Impl::orderedEntries(Impl::map(*this))) {
+                result[e->key] = e->value.toNode();
+            }
+            return result;
+        }
+        return Node();
+    }
+
+    bool PersistentNode::isNull() const                      { return !_data; }
+    bool PersistentNode::isAtom() const                      { return _data && _data->kind == Kind_ATOM; }
+    bool PersistentNode::isVector() const                    { return _data && _data->kind == Kind_VECTOR; }
+    bool PersistentNode::isMap() const                       { return _data && _data->kind == Kind_MAP; }
+
+    bool PersistentNode::sharesWith(const PersistentNode& other) const {
+        return _data == other._data;
+    }
+
+    const std::string& PersistentNode::atom() const {
+        assert(isAtom());
+        return Impl::atom(*this).value;
+    }
+
+    size_t PersistentNode::length() const {
+        if (isVector()) {
+            return Impl::vector(*this).size;
+        }
+        else if (isNull()) {
+            return 0;
+        }
+        else {
+            return 1;
+        }
+    }
+
+    const PersistentNode& PersistentNode::operator[](size_t pos) const {
+        assert(isVector() && pos < length());
+        return Impl::vectorAt(Impl::vector(*this), pos);
+    }
+
+    PersistentNode PersistentNode::set(size_t pos, PersistentNode value) const {
+        assert(isVector() && pos < length());
+        auto& v = Impl::vector(*this);
+        auto data = std::make_shared<Impl::VectorData>(v);
+        data->root = Impl::vectorSet(v.root, v.shift, pos, std::move(value));
+        return PersistentNode(std::move(data));
+    }
+
+    PersistentNode PersistentNode::push_back(PersistentNode value) const {
+        assert(isNull() || isVector());
+        auto data = isVector() ? std::make_shared<Impl::VectorData>(Impl::vector(*this)) : std::make_shared<Impl::VectorData>();
+        if (data->root && data->size == (Impl::WIDTH << data->shift)) {
+            auto root = std::make_shared<Impl::VectorChunk>();
+            root->children.push_back(std::move(data->root));
+            data->root = std::move(root);
+            data->shift += Impl::BITS;
+        }
+        data->root = Impl::vectorAppend(data->root, data->shift, data->size, std::move(value));
+        data->size += 1;
+        return PersistentNode(std::move(data));
+    }
+
+    size_t PersistentNode::mapSize() const {
+        return isMap() ? Impl::map(*this).size : 0;
+    }
+
+    std::vector<std::pair<std::string_view, const PersistentNode*>> PersistentNode::entries() const {
+        std::vector<std::pair<std::string_view, const PersistentNode*>> result;
+        if (isMap()) {
+            for (auto* e : Impl::orderedEntries(Impl::map(*this))) {
+                result.emplace_back(e->key, &e->value);
+            }
+        }
+        return result;
+    }
+
+    const PersistentNode& PersistentNode::operator[](std::string_view key) const {
+        const PersistentNode* node = find(key);
+        return node != nullptr ? *node : NULL_NODE;
+    }
+
+    const PersistentNode& PersistentNode::operator[](const char* key) const {
+        return (*this)[std::string_view(key)];
+    }
+
+    const PersistentNode& PersistentNode::operator[](const Key& key) const {
+        const PersistentNode* node = find(key);
+        return node != nullptr ? *node : NULL_NODE;
+    }
+
+    const PersistentNode* PersistentNode::find(std::string_view key) const {
+        return find(Key(key));
+    }
+
+    const PersistentNode* PersistentNode::find(const Key& key) const {
+        if (!isMap()) {
+            return nullptr;
+        }
+        auto* e = Impl::mapFind(Impl::map(*this).root.get(), key.name(), key.hash());
+        return e != nullptr ? &e->value : nullptr;
+    }
+
+    PersistentNode PersistentNode::set(std::string_view key, PersistentNode value) const {
+        assert(isNull() || isMap());
+        auto data = isMap() ? std::make_shared<Impl::MapData>(Impl::map(*this)) : std::make_shared<Impl::MapData>();
+        bool added = false;
+        Impl::MapEntry entry{ std::string(key), hashKey(key), data->nextSeq, std::move(value) };
+        data->root = Impl::mapSet(data->root, std::move(entry), 0, added);
+        if (added) {
+            data->size += 1;
+            data->nextSeq += 1;
+        }
+        return PersistentNode(std::move(data));
+    }
+
+    PersistentNode PersistentNode::erase(std::string_view key) const {
+        if (!isMap()) {
+            return *this;
+        }
+        auto& m = Impl::map(*this);
+        bool removed = false;
+        auto root = m.root ? Impl::mapErase(m.root, key, hashKey(key), 0, removed) : nullptr;
+        if (!removed) {
+            return *this;
+        }
+        auto data = std::make_shared<Impl::MapData>(m);
+        data->root = std::move(root);
+        data->size -= 1;
+        return PersistentNode(std::move(data));
+    }
+}
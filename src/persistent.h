@@ -0,0 +1,96 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <memory>
+#include <vector>
+#include <utility>
+#include <cstdint>
+
+#include "conf.h"
+#include "node.h"
+#include "key.h"
+
+namespace keson
+{
+    // Immutable counterpart of Node for keeping many versions of one document, such as
+    // an undo history.
+    //
+    // Every edit returns a new version and leaves the old one intact. The two share all
+    // structure the edit did not touch: maps are hash array mapped tries and vectors are
+    // tries of 32 element chunks, so an edit copies O(log n) small blocks per level of the
+    // document instead of the whole tree. Versions are cheap to copy and safe to share
+    // between threads.
+    //
+    // Map entries keep their insertion order, which toNode() and entries() follow.
+    class PersistentNode {
+    public:
+        PersistentNode();
+        PersistentNode(const Node& node);
+        PersistentNode(std::string value);
+        PersistentNode(const char* value);
+
+        Node toNode() const;
+
+        bool isNull() const;
+        bool isAtom() const;
+        bool isVector() const;
+        bool isMap() const;
+
+        // True if both refer to the same stored value, meaning one was derived from the
+        // other without editing this part. Equal values built separately do not share.
+        bool sharesWith(const PersistentNode& other) const;
+
+        //////////
+        // Atom //
+        //////////
+
+        const std::string& atom() const;
+
+        ////////////
+        // Vector //
+        ////////////
+
+        size_t length() const;
+
+        const PersistentNode& operator[](size_t pos) const;
+
+        PersistentNode set(size_t pos, PersistentNode value) const;
+        PersistentNode push_back(PersistentNode value) const;
+
+        /////////
+        // Map //
+        /////////
+
+        size_t mapSize() const;
+
+        std::vector<std::pair<std::string_view, const PersistentNode*>> entries() const;
+
+        const PersistentNode& operator[](std::string_view key) const;
+        const PersistentNode& operator[](const char* key) const;
+        const PersistentNode& operator[](const Key& key) const;
+
+        const PersistentNode* find(std::string_view key) const;
+        const PersistentNode* find(const Key& key) const;
+
+        // Setting a key on a null node makes it a map.
+        PersistentNode set(std::string_view key, PersistentNode value) const;
+        PersistentNode erase(std::string_view key) const;
+
+    private:
+        enum Kind : uint8_t {
+            Kind_ATOM,
+            Kind_VECTOR,
+            Kind_MAP,
+        };
+
+        struct Data;
+        struct Impl;
+        friend struct Impl;
+
+        explicit PersistentNode(std::shared_ptr<const Data> data);
+
+        static const PersistentNode NULL_NODE;
+        std::shared_ptr<const Data> _data;
+    };
+}
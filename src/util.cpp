@@ -1,72 +1,200 @@
-#include "util.h"
-
-#include <charconv>
-#include <cassert>
-
-#if KESON_ENABLE_WSTRING
-#include <codecvt>
-#endif
-
-namespace keson
-{
-#if KESON_ENABLE_WSTRING
-    // TODO: Replace with something not deprecated
-    std::string to_utf8(const std::wstring& s) {
-        return std::wstring_convert<std::codecvt_utf8<wchar_t>>{}.to_bytes(s);
-    }
-
-    std::wstring from_utf8(const std::string& s) {
-        return std::wstring_convert<std::codecvt_utf8<wchar_t>>{}.from_bytes(s);
-    }
-#endif
-    template <typename T>
-    static std::string arithmetic_to_string(T v) {
-        char tmp[100];
-        auto result = std::to_chars(tmp, tmp + sizeof(tmp), v);
-        assert(result.ec == (std::errc)0);
-        return std::string(tmp, result.ptr);
-    }
-
-    template <typename T>
-    static T int_from_string(const std::string& s) {
-        // TODO: Handle 0x, 0o, 0b prefixes?
-        T v;
-        auto result = std::from_chars(s.data(), s.data() + s.size(), v);
-        assert(result.ec == (std::errc)0);
-        assert(result.ptr == s.data() + s.size());
-        return v;
-    }
-
-    template <typename T>
-    static T float_from_string(const std::string& s) {
-        T v;
-        auto result = std::from_chars(s.data(), s.data() + s.size(), v);
-        assert(result.ec == (std::errc)0);
-        assert(result.ptr == s.data() + s.size());
-        return v;
-    }
-
-    std::string to_string(uint8_t  v) { return arithmetic_to_string(v); }
-    std::string to_string(int8_t   v) { return arithmetic_to_string(v); }
-    std::string to_string(uint16_t v) { return arithmetic_to_string(v); }
-    std::string to_string(int16_t  v) { return arithmetic_to_string(v); }
-    std::string to_string(uint32_t v) { return arithmetic_to_string(v); }
-    std::string to_string(int32_t  v) { return arithmetic_to_string(v); }
-    std::string to_string(uint64_t v) { return arithmetic_to_string(v); }
-    std::string to_string(int64_t  v) { return arithmetic_to_string(v); }
-    std::string to_string(double   v) { return arithmetic_to_string(v); }
-    std::string to_string(float    v) { return arithmetic_to_string(v); }
-    std::string to_string(bool     v) { return v ? "true" : "false"; }
-    
-    template<> uint8_t  from_string<uint8_t>  (const std::string& s) { return int_from_string<uint8_t>(s);  }
-    template<> int8_t   from_string<int8_t>   (const std::string& s) { return int_from_string<int8_t>(s);   }
-    template<> uint16_t from_string<uint16_t> (const std::string& s) { return int_from_string<uint16_t>(s); }
-    template<> int16_t  from_string<int16_t>  (const std::string& s) { return int_from_string<int16_t>(s);  }
-    template<> uint32_t from_string<uint32_t> (const std::string& s) { return int_from_string<uint32_t>(s); }
-    template<> int32_t  from_string<int32_t>  (const std::string& s) { return int_from_string<int32_t>(s);  }
-    template<> uint64_t from_string<uint64_t> (const std::string& s) { return int_from_string<uint64_t>(s); }
-    template<> int64_t  from_string<int64_t>  (const std::string& s) { return int_from_string<int64_t>(s);  }
-    template<> float    from_string<float>    (const std::string& s) { return float_from_string<float>(s);  }
-    template<> double   from_string<double>   (const std::string& s) { return float_from_string<double>(s); }
-    template<> bool     from_string<bool>     (const std::string& s) { return s == "true";                  }
-}
+#include "util.h"
+
+#include <charconv>
+#include <cassert>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
+#if KESON_ENABLE_WSTRING
+#include <codecvt>
+#endif
+
+namespace keson
+{
+#if KESON_ENABLE_WSTRING
+    // TODO: Replace with something not deprecated
+    std::string to_utf8(const std::wstring& s) {
+        return std::wstring_convert<std::codecvt_utf8<wchar_t>>{}.to_bytes(s);
+    }
+
+    std::wstring from_utf8(const std::string& s) {
+        return std::wstring_convert<std::codecvt_utf8<wchar_t>>{}.from_bytes(s);
+    }
+#endif
+    template <typename T>
+    static std::string arithmetic_to_string(T v) {
+        char tmp[100];
+        auto result = std::to_chars(tmp, tmp + sizeof(tmp), v);
+        assert(result.ec == (std::errc)0);
+        return std::string(tmp, result.ptr);
+    }
+
+    static bool is_little_endian() {
+        const uint16_t one = 1;
+        uint8_t first;
+        memcpy(&first, &one, 1);
+        return first == 1;
+    }
+
+    // True if all eight bytes of a little endian word are ASCII digits.
+    static bool is_eight_digits(uint64_t v) {
+        return ((v & 0xF0F0F0F0F0F0F0F0) | (((v + 0x0606060606060606) & 0xF0F0F0F0F0F0F0F0) >> 4))
+            == 0x3333333333333333;
+    }
+
+    // Converts eight ASCII digits in a little endian word to their value, combining
+    // digit pairs, then pairs of pairs, with three multiplications.
+    static uint64_t parse_eight_digits(uint64_t v) {
+        v -= 0x3030303030303030;
+        v = (v * 10) + (v >> 8);
+        return (((v & 0x000000FF000000FF) * (100 + (1000000ULL << 32)))
+            + (((v >> 16) & 0x000000FF000000FF) * (1 + (10000ULL << 32)))) >> 32;
+    }
+
+    static unsigned digit_value(char c) {
+        if (c >= '0' && c <= '9') { return c - '0'; }
+        if (c >= 'a' && c <= 'z') { return c - 'a' + 10; }
+        if (c >= 'A' && c <= 'Z') { return c - 'A' + 10; }
+        return 255;
+    }
+
+    // Parses unsigned digits in the given base. Fails on empty input, invalid digits
+    // and values that do not fit 64 bits.
+    static bool parse_digits(std::string_view s, unsigned base, uint64_t& out) {
+        if (s.empty()) {
+            return false;
+        }
+
+        uint64_t v = 0;
+        size_t i = 0;
+        if (base == 10 && is_little_endian()) {
+            for (; i + 8 <= s.size(); i += 8) {
+                uint64_t word;
+                memcpy(&word, s.data() + i, 8);
+                if (!is_eight_digits(word)) {
+                    break;
+                }
+                uint64_t chunk = parse_eight_digits(word);
+                if (v > (UINT64_MAX - chunk) / 100000000) {
+                    return false;
+                }
+                v = v * 100000000 + chunk;
+            }
+        }
+
+        for (; i < s.size(); i++) {
+            unsigned d = digit_value(s[i]);
+            if (d >= base || v > (UINT64_MAX - d) / base) {
+                return false;
+            }
+            v = v * base + d;
+        }
+        out = v;
+        return true;
+    }
+
+    template <typename T>
+    static std::optional<T> try_int_from_string(std::string_view s) {
+        bool negative = false;
+        if (!s.empty() && (s[0] == '-' || s[0] == '+')) {
+            negative = s[0] == '-';
+            s.remove_prefix(1);
+        }
+
+        unsigned base = 10;
+        if (s.size() > 2 && s[0] == '0') {
+            switch (s[1]) {
+            case 'x': case 'X': base = 16; break;
+            case 'o': case 'O': base = 8;  break;
+            case 'b': case 'B': base = 2;  break;
+            }
+            if (base != 10) {
+                s.remove_prefix(2);
+            }
+        }
+
+        uint64_t magnitude;
+        if (!parse_digits(s, base, magnitude)) {
+            return std::nullopt;
+        }
+
+        if (negative) {
+            if (magnitude == 0) {
+                return T(0);
+            }
+            if (!std::is_signed_v<T> || magnitude - 1 > (uint64_t)std::numeric_limits<T>::max()) {
+                return std::nullopt;
+            }
+            return (T)(-(T)(magnitude - 1) - 1);
+        }
+        if (magnitude > (uint64_t)std::numeric_limits<T>::max()) {
+            return std::nullopt;
+        }
+        return (T)magnitude;
+    }
+
+    template <typename T>
+    static std::optional<T> try_float_from_string(std::string_view s) {
+        T v;
+        auto result = std::from_chars(s.data(), s.data() + s.size(), v);
+        if (result.ec != (std::errc)0 || result.ptr != s.data() + s.size()) {
+            return std::nullopt;
+        }
+        return v;
+    }
+
+    template <typename T>
+    static T int_from_string(std::string_view s) {
+        auto v = try_int_from_string<T>(s);
+        assert(v);
+        return v.value_or(T(0));
+    }
+
+    template <typename T>
+    static T float_from_string(std::string_view s) {
+        auto v = try_float_from_string<T>(s);
+        assert(v);
+        return v.value_or(T(0));
+    }
+
+    std::string to_string(uint8_t  v) { return arithmetic_to_string(v); }
+    std::string to_string(int8_t   v) { return arithmetic_to_string(v); }
+    std::string to_string(uint16_t v) { return arithmetic_to_string(v); }
+    std::string to_string(int16_t  v) { return arithmetic_to_string(v); }
+    std::string to_string(uint32_t v) { return arithmetic_to_string(v); }
+    std::string to_string(int32_t  v) { return arithmetic_to_string(v); }
+    std::string to_string(uint64_t v) { return arithmetic_to_string(v); }
+    std::string to_string(int64_t  v) { return arithmetic_to_string(v); }
+    std::string to_string(double   v) { return arithmetic_to_string(v); }
+    std::string to_string(float    v) { return arithmetic_to_string(v); }
+    std::string to_string(bool     v) { return v ? "true" : "false"; }
+    
+    template<> uint8_t  from_string<uint8_t>  (std::string_view s) { return int_from_string<uint8_t>(s);  }
+    template<> int8_t   from_string<int8_t>   (std::string_view s) { return int_from_string<int8_t>(s);   }
+    template<> uint16_t from_string<uint16_t> (std::string_view s) { return int_from_string<uint16_t>(s); }
+    template<> int16_t  from_string<int16_t>  (std::string_view s) { return int_from_string<int16_t>(s);  }
+    template<> uint32_t from_string<uint32_t> (std::string_view s) { return int_from_string<uint32_t>(s); }
+    template<> int32_t  from_string<int32_t>  (std::string_view s) { return int_from_string<int32_t>(s);  }
+    template<> uint64_t from_string<uint64_t> (std::string_view s) { return int_from_string<uint64_t>(s); }
+    template<> int64_t  from_string<int64_t>  (std::string_view s) { return int_from_string<int64_t>(s);  }
+    template<> float    from_string<float>    (std::string_view s) { return float_from_string<float>(s);  }
+    template<> double   from_string<double>   (std::string_view s) { return float_from_string<double>(s); }
+    template<> bool     from_string<bool>     (std::string_view s) { return s == "true";                  }
+
+    template<> std::optional<uint8_t>  try_from_string<uint8_t>  (std::string_view s) { return try_int_from_string<uint8_t>(s);  }
+    template<> std::optional<int8_t>   try_from_string<int8_t>   (std::string_view s) { return try_int_from_string<int8_t>(s);   }
+    template<> std::optional<uint16_t> try_from_string<uint16_t> (std::string_view s) { return try_int_from_string<uint16_t>(s); }
+    template<> std::optional<int16_t>  try_from_string<int16_t>  (std::string_view s) { return try_int_from_string<int16_t>(s);  }
+    template<> std::optional<uint32_t> try_from_string<uint32_t> (std::string_view s) { return try_int_from_string<uint32_t>(s); }
+    template<> std::optional<int32_t>  try_from_string<int32_t>  (std::string_view s) { return try_int_from_string<int32_t>(s);  }
+    template<> std::optional<uint64_t> try_from_string<uint64_t> (std::string_view s) { return try_int_from_string<uint64_t>(s); }
+    template<> std::optional<int64_t>  try_from_string<int64_t>  (std::string_view s) { return try_int_from_string<int64_t>(s);  }
+    template<> std::optional<float>    try_from_string<float>    (std::string_view s) { return try_float_from_string<float>(s);  }
+    template<> std::optional<double>   try_from_string<double>   (std::string_view s) { return try_float_from_string<double>(s); }
+    template<> std::optional<bool>     try_from_string<bool>     (std::string_view s) {
+        if (s == "true")  { return true; }
+        if (s == "false") { return false; }
+        return std::nullopt;
+    }
+}
@@ -1,39 +1,57 @@
-#pragma once
-
-#include <string>
-
-#include "conf.h"
-
-namespace keson
-{
-#if KESON_ENABLE_WSTRING
-    std::string to_utf8(const std::wstring& s);
-
-    std::wstring from_utf8(const std::string& s);
-#endif
-
-    std::string to_string(uint8_t  v);
-    std::string to_string(int8_t   v);
-    std::string to_string(uint16_t v);
-    std::string to_string(int16_t  v);
-    std::string to_string(uint32_t v);
-    std::string to_string(int32_t  v);
-    std::string to_string(uint64_t v);
-    std::string to_string(int64_t  v);
-    std::string to_string(float    v);
-    std::string to_string(double   v);
-    std::string to_string(bool     v);
-    
-    template<typename T> T        from_string           (const std::string& s);
-    template<>           uint8_t  from_string<uint8_t>  (const std::string& s);
-    template<>           int8_t   from_string<int8_t>   (const std::string& s);
-    template<>           uint16_t from_string<uint16_t> (const std::string& s);
-    template<>           int16_t  from_string<int16_t>  (const std::string& s);
-    template<>           uint32_t from_string<uint32_t> (const std::string& s);
-    template<>           int32_t  from_string<int32_t>  (const std::string& s);
-    template<>           uint64_t from_string<uint64_t> (const std::string& s);
-    template<>           int64_t  from_string<int64_t>  (const std::string& s);
-    template<>           float    from_string<float>    (const std::string& s);
-    template<>           double   from_string<double>   (const std::string& s);
-    template<>           bool     from_string<bool>     (const std::string& s);
-}
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <optional>
+#include <cstdint>
+
+#include "conf.h"
+
+namespace keson
+{
+#if KESON_ENABLE_WSTRING
+    std::string to_utf8(const std::wstring& s);
+
+    std::wstring from_utf8(const std::string& s);
+#endif
+
+    std::string to_string(uint8_t  v);
+    std::string to_string(int8_t   v);
+    std::string to_string(uint16_t v);
+    std::string to_string(int16_t  v);
+    std::string to_string(uint32_t v);
+    std::string to_string(int32_t  v);
+    std::string to_string(uint64_t v);
+    std::string to_string(int64_t  v);
+    std::string to_string(float    v);
+    std::string to_string(double   v);
+    std::string to_string(bool     v);
+    
+    template<typename T> T        from_string           (std::string_view s);
+    template<>           uint8_t  from_string<uint8_t>  (std::string_view s);
+    template<>           int8_t   from_string<int8_t>   (std::string_view s);
+    template<>           uint16_t from_string<uint16_t> (std::string_view s);
+    template<>           int16_t  from_string<int16_t>  (std::string_view s);
+    template<>           uint32_t from_string<uint32_t> (std::string_view s);
+    template<>           int32_t  from_string<int32_t>  (std::string_view s);
+    template<>           uint64_t from_string<uint64_t> (std::string_view s);
+    template<>           int64_t  from_string<int64_t>  (std::string_view s);
+    template<>           float    from_string<float>    (std::string_view s);
+    template<>           double   from_string<double>   (std::string_view s);
+    template<>           bool     from_string<bool>     (std::string_view s);
+
+    // Returns nullopt unless all of s is a valid value in range. Integers may carry a
+    // sign and a 0x, 0o or 0b prefix.
+    template<typename T> std::optional<T>        try_from_string           (std::string_view s);
+    template<>           std::optional<uint8_t>  try_from_string<uint8_t>   (std::string_view s);
+    template<>           std::optional<int8_t>   try_from_string<int8_t>    (std::string_view s);
+    template<>           std::optional<uint16_t> try_from_string<uint16_t>  (std::string_view s);
+    template<>           std::optional<int16_t>  try_from_string<int16_t>   (std::string_view s);
+    template<>           std::optional<uint32_t> try_from_string<uint32_t>  (std::string_view s);
+    template<>           std::optional<int32_t>  try_from_string<int32_t>   (std::string_view s);
+    template<>           std::optional<uint64_t> try_from_string<uint64_t>  (std::string_view s);
+    template<>           std::optional<int64_t>  try_from_string<int64_t>   (std::string_view s);
+    template<>           std::optional<float>    try_from_string<float>     (std::string_view s);
+    template<>           std::optional<double>   try_from_string<double>    (std::string_view s);
+    template<>           std::optional<bool>     try_from_string<bool>      (std::string_view s);
+}
@@ -1,45 +1,124 @@
-#include "node.h"
-#include "encode.h"
-#include "decode.h"
-#include "catch.h"
-
-#include <iostream>
-
-using namespace keson;
-
-const char* KESON_TEXT = R"(
-	{
-		people: [
-			{ 
-				name: Bengan
-				age: 23
-				hobbies: [Cars, Babes]
-			},,
-			{ 
-				name: "G\xe5ndalf"
-				"age": 123
-				hobbies: ["Wizardry", "The number 23" Hobbits]
-			}
-			{ 
-				name: "\u7A40"
-				"age": 6
-				hobbies: [Anime, 'Quotation marks that look like "']
-			},
-		]
-		animals: [
-			Dog,
-			"Cat"
-			Bat
-		]
-	}
-)";
-
-TEST_CASE("Decode")
-{
-	auto result = decode(KESON_TEXT);
-	
-	REQUIRE(std::holds_alternative<Node>(result));
-
-	std::cout << encode(std::get<Node>(result), Flags_RELAXED_QUOTES | Flag_PRETTY_PRINT | Flag_INDENT_WITH_SPACES);
-	std::cout << encode(std::get<Node>(result), Flags_JSON_STYLE_QUOTES | Flag_PRETTY_PRINT | Flag_INDENT_WITH_SPACES);
+#include "node.h"
+#include "encode.h"
+#include "decode.h"
+#include "catch.h"
+
+#include <iostream>
+
+using namespace keson;
+
+const char* KESON_TEXT = R"(
+	{
+		people: [
+			{ 
+				name: Bengan
+				age: 23
+				hobbies: [Cars, Babes]
+			},,
+			{ 
+				name: "G\xe5ndalf"
+				"age": 123
+				hobbies: ["Wizardry", "The number 23" Hobbits]
+			}
+			{ 
+				name: "\u7A40"
+				"age": 6
+				hobbies: [Anime, 'Quotation marks that look like "']
+			},
+		]
+		animals: [
+			Dog,
+			"Cat"
+			Bat
+		]
+	}
+)";
+
+TEST_CASE("Decode")
+{
+	auto result = decode(KESON_TEXT);
+	
+	REQUIRE(std::holds_alternative<Node>(result));
+
+	std::cout << encode(std::get<Node>(result), Flags_RELAXED_QUOTES | Flag_PRETTY_PRINT | Flag_INDENT_WITH_SPACES);
+	std::cout << encode(std::get<Node>(result), Flags_JSON_STYLE_QUOTES | Flag_PRETTY_PRINT | Flag_INDENT_WITH_SPACES);
+}
+
+TEST_CASE("Decode into existing tree")
+{
+	Decoder decoder;
+	Node message;
+
+	REQUIRE(!decoder.decodeInto(message, "{ id: 1, name: 'the first message', values: [1, 2, 3], extra: x }"));
+	const char* name = message["name"].atom().data();
+	const Node* values = message["values"].begin();
+
+	REQUIRE(!decoder.decodeInto(message, "{ id: 2, values: [4, 5], name: 'the second message' }"));
+	CHECK(message == std::get<Node>(decode("{ id: 2, values: [4, 5], name: 'the second message' }")));
+	CHECK(encode(message, Flags_RELAXED_QUOTES) == "{id:2,values:[4,5],name:\"the second message\"}");
+	CHECK(message["name"].atom().data() == name);
+	CHECK(message["values"].begin() == values);
+
+	CHECK(decoder.decodeInto(message, "{ id: [ }").has_value());
+	CHECK(decoder.decodeInto(message, "[1, 2").has_value());
+}
+
+TEST_CASE("Decode numeric arrays into bound buffers")
+{
+	float table[4];
+	size_t tableSize = 99;
+	int32_t steps[2];
+	size_t stepCount = 99;
+
+	Decoder decoder;
+	decoder.bindArray({ "osc", "table" }, table, 4, tableSize);
+	decoder.bindArray({ "steps" }, steps, 2, stepCount);
+
+	Node preset;
+	REQUIRE(!decoder.decodeInto(preset, "{ name: saw, osc: { table: [0, 0.5, -1], gain: 2 }, other: [{ steps: [1] }] }"));
+	CHECK(tableSize == 3);
+	CHECK(table[1] == 0.5f);
+	CHECK(table[2] == -1.0f);
+	CHECK(stepCount == 0);
+	CHECK(encode(preset, Flags_RELAXED_QUOTES) == "{name:saw,osc:{gain:2},other:[{steps:[1]}]}");
+
+	CHECK(decoder.decodeInto(preset, "{ steps: [1, 2, 3] }").has_value());
+	CHECK(decoder.decodeInto(preset, "{ steps: [1, x] }").has_value());
+	CHECK(decoder.decodeInto(preset, "{ steps: 1 }").has_value());
+}
+
+TEST_CASE("Decode numeric vectors as packed arrays")
+{
+	auto decodePacked = [](const std::string& s) { return std::get<Node>(decode(s, Decode_PACK_NUMERIC_VECTORS)); };
+
+	Node ints = decodePacked("[1, -2, 3]");
+	REQUIRE(ints.isPacked());
+	CHECK(std::holds_alternative<std::vector<int64_t>>(ints.packed()));
+
+	Node doubles = decodePacked("{ curve: [1, 0.25, -3] }")["curve"];
+	REQUIRE(doubles.isPacked());
+	CHECK(std::get<std::vector<double>>(doubles.packed())[1] == 0.25);
+
+	for (const char* text : { "[1,1.0]", "[0x10,2]", "[1,2,x]", "[1,[2]]", "[3,\"a b\"]" }) {
+		Node node = decodePacked(text);
+		CHECK(node.isVector());
+		CHECK(encode(node, Flags_RELAXED_QUOTES) == text);
+	}
+
+	// Quoted string values quote packed elements like the atoms they were decoded from
+	for (const char* text : { "[1,-2,3]", "[\"1\",\"2\"]", "[0.25,-1e+20]" }) {
+		Node plain = std::get<Node>(decode(text));
+		Node packed = decodePacked(text);
+		CHECK(packed.isPacked());
+		for (uint32_t flags : { (uint32_t)Flags_JSON_STYLE_QUOTES, (uint32_t)Flags_PTREE_STYLE_QUOTES,
+				(uint32_t)(Flags_JSON_STYLE_QUOTES | Flag_PRETTY_PRINT) }) {
+			CHECK(encode(packed, flags) == encode(plain, flags));
+		}
+	}
+	std::string json = encode(decodePacked("[\"1\",\"2\"]"), Flags_JSON_STYLE_QUOTES);
+	CHECK(json == "[\"1\",\"2\"]");
+	CHECK(encode(decodePacked(json), Flags_JSON_STYLE_QUOTES) == json);
+
+	CHECK(decodePacked("[]").isNull());
+	CHECK(std::holds_alternative<ParseError>(decode("[1, 2", Decode_PACK_NUMERIC_VECTORS)));
 }
\ No newline at end of file
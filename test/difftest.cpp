@@ -0,0 +1,108 @@
+#include "node.h"
+#include "diff.h"
+#include "encode.h"
+#include "decode.h"
+#include "catch.h"
+
+using namespace keson;
+
+TEST_CASE("Diff and apply")
+{
+	Node a;
+	a["name"] = "Init";
+	a["osc"]["shape"] = "saw";
+	a["fx"]["delay"]["time"] = 0.25;
+	for (int i = 0; i < 50; i++) {
+		a["table"].push_back(i);
+	}
+
+	Node b = a;
+	b["osc"]["shape"] = "square";
+	b["fx"].map().erase("delay");
+	b["fx"]["reverb"]["size"] = 3;
+	auto& table = b["table"].vector();
+	table.insert(table.begin() + 10, Node("inserted"));
+	table.erase(table.begin() + 40);
+
+	Patch patch = diff(a, b);
+	CHECK(patch.size() == 5);
+	CHECK(diff(a, a).empty());
+
+	Node c = a;
+	CHECK(keson::apply(c, patch));
+	CHECK(c == b);
+	CHECK(encode(c) == encode(b));
+}
+
+TEST_CASE("Diff sees writes through held references")
+{
+	Node c;
+	c["p"]["g"] = 1;
+	c["list"].push_back(1);
+	c["list"].push_back(2);
+	Node d;
+	d["p"]["g"] = 1;
+	d["list"].push_back(1);
+	d["list"].push_back(2);
+
+	Node& dp = d["p"];
+	Node& last = d["list"][1];
+	CHECK(diff(c, d).empty());
+
+	dp["g"] = 5;
+	Patch patch = diff(c, d);
+	REQUIRE(patch.size() == 1);
+	CHECK(patch[0].type == PatchOp::Type_SET);
+
+	last = 3;
+	CHECK(diff(c, d).size() == 2);
+	CHECK(keson::apply(c, diff(c, d)));
+	CHECK(c == d);
+}
+
+TEST_CASE("Diff leaves both trees writable")
+{
+	Node a;
+	Node b;
+	b["inner"]["v"] = 1;
+	Node& v = b["inner"]["v"];
+
+	Patch patch = diff(a, b);
+	REQUIRE(patch.size() == 1);
+	b.hash();
+	v = 2;
+
+	Node c;
+	c["inner"]["v"] = 2;
+	CHECK(b == c);
+	CHECK(b.hash() == c.hash());
+	CHECK(b == c.snapshot());
+	CHECK(encode(b) == encode(c));
+
+	Node expected;
+	expected["inner"]["v"] = 1;
+	CHECK(keson::apply(a, patch));
+	CHECK(a == expected);
+}
+
+TEST_CASE("Patches survive encoding")
+{
+	Node a;
+	a["list"].push_back("x");
+	a["list"].push_back("y");
+
+	Node b = a;
+	b["list"][1] = "changed";
+	b["list"].push_back()["nested"] = "z";
+	b["extra"] = 1;
+
+	auto decoded = decode(encode(patchToNode(diff(a, b))));
+	REQUIRE(std::holds_alternative<Node>(decoded));
+	auto patch = patchFromNode(std::get<Node>(decoded));
+	REQUIRE(std::holds_alternative<Patch>(patch));
+
+	CHECK(keson::apply(a, std::get<Patch>(patch)));
+	CHECK(a == b);
+
+	CHECK(!keson::apply(a, Patch{ { PatchOp::Type_REMOVE, Path{ std::string("missing") }, Node() } }));
+}
@@ -1,21 +1,405 @@
-#include "node.h"
-#include "encode.h"
-#include "decode.h"
-#include "catch.h"
-
-#include <iostream>
-
-using namespace keson;
-
-TEST_CASE("Preserves utf-8")
-{
-	Node v = "\xe7\xa9\x85";
-	CHECK(encode(v) == "\"\xe7\xa9\x85\"");
-}
-
-
-TEST_CASE("Escapes stuff")
-{
-	Node v = "\\\n\t\f\r\v\"\'\x12";
-	CHECK(encode(v) == "\"\\\\\\n\\t\\f\\r\\v\\\"'\\x12\""); // eugh
-}
+#include "node.h"
+#include "encode.h"
+#include "decode.h"
+#include "catch.h"
+
+#include <iostream>
+
+using namespace keson;
+
+TEST_CASE("Preserves utf-8")
+{
+	Node v = "\xe7\xa9\x85";
+	CHECK(encode(v) == "\"\xe7\xa9\x85\"");
+}
+
+
+TEST_CASE("Escapes stuff")
+{
+	Node v = "\\\n\t\f\r\v\"\'\x12";
+	CHECK(encode(v) == "\"\\\\\\n\\t\\f\\r\\v\\\"'\\x12\""); // eugh
+}
+
+TEST_CASE("Escapes in long strings")
+{
+	std::string clean = "abcdefghijklmnopqrstuvwxyz \xc3\xa9 0123456789";
+	Node v = clean + "\x7f" + clean + "\"" + clean + "\x1f";
+	CHECK(encode(v) == "\"" + clean + "\\x7f" + clean + "\\\"" + clean + "\\x1f\"");
+	CHECK(encode(v, Flag_PREFER_SINGLE_QUOTES) == "'" + clean + "\\x7f" + clean + "\"" + clean + "\\x1f'");
+}
+
+// Strings covering every quoting and escaping decision the writer makes
+static Node sampleDocument()
+{
+	Node node;
+	node["name"] = "Lead / Saw";
+	node["path"] = "C:\\Presets\\lead.kes";
+	node["quotes"] = Node::Vector{ "it's", "say \"hi\"", "both ' and \"", "" };
+	node["safe"] = Node::Vector{ "a-b", "x@y.z", "1/2", "a//b", "a/*b", "tab\there", "\x7f\x01", "caf\xc3\xa9" };
+	node["nested"]["levels"][1] = Node::Vector{ "1", "2" };
+	node["nested"]["levels"][2]["deep"] = Node::Vector{ "true", "false", "-1.5e-3" };
+	node["needs quotes"] = "line one\nline two";
+	return node;
+}
+
+template<uint32_t Flags>
+static void checkCompileTimeFlags(const Node& node)
+{
+	CHECK(encode<Flags>(node) == encode(node, Flags));
+}
+
+TEST_CASE("Compile time flags match runtime flags")
+{
+	Node node = sampleDocument();
+
+	checkCompileTimeFlags<0>(node);
+	checkCompileTimeFlags<Flags_RELAXED_QUOTES>(node);
+	checkCompileTimeFlags<Flags_JSON_STYLE_QUOTES | Flag_PRETTY_PRINT>(node);
+	checkCompileTimeFlags<Flags_PTREE_STYLE_QUOTES | Flag_PRETTY_PRINT | Flag_INDENT_WITH_SPACES | Flag_CRLF_NEWLINES>(node);
+	checkCompileTimeFlags<Flag_PREFER_SINGLE_QUOTES | Flag_FLEXIBLE_QUOTES | Flag_EXTENDED_SAFE_CHARS>(node);
+}
+
+TEST_CASE("Writer buffers output for its sink")
+{
+	Node node = sampleDocument();
+	uint32_t flags = Flags_RELAXED_QUOTES | Flag_PRETTY_PRINT;
+	std::string expected = encode(node, flags);
+
+	std::string small;
+	StringSink sink(small);
+	{
+		Writer w(sink, flags, 8);
+		encode(w, node);
+		w.printNewline();
+	}
+	CHECK(small == expected);
+
+	std::string top;
+	StringSink topSink(top);
+	Writer w(topSink);
+	{
+		auto m = w.map();
+		m["a"] = std::string("b");
+		CHECK(top.empty());
+	}
+	CHECK(top == "{a:b}");
+
+	FILE* file = tmpfile();
+	REQUIRE(file != nullptr);
+	FileSink fileSink(file);
+	{
+		Writer fw(fileSink, flags);
+		encode(fw, node);
+		fw.printNewline();
+	}
+	std::string contents(expected.size() + 1, '\0');
+	rewind(file);
+	contents.resize(fread(&contents[0], 1, contents.size(), file));
+	fclose(file);
+	CHECK(contents == expected);
+}
+
+TEST_CASE("Encode into a sized buffer")
+{
+	Node node = sampleDocument();
+	for (uint32_t flags : { 0u, Flags_RELAXED_QUOTES | Flag_PRETTY_PRINT, Flags_JSON_STYLE_QUOTES | Flag_PRETTY_PRINT | Flag_CRLF_NEWLINES }) {
+		std::string expected = encode(node, flags);
+		REQUIRE(encodedSize(node, flags) == expected.size());
+
+		std::vector<char> buffer(expected.size());
+		CHECK(encodeTo(buffer.data(), buffer.size(), node, flags) == expected.size());
+		CHECK(std::string(buffer.begin(), buffer.end()) == expected);
+
+		std::vector<char> small(10);
+		CHECK(encodeTo(small.data(), small.size(), node, flags) == expected.size());
+		CHECK(std::string(small.begin(), small.end()) == expected.substr(0, 10));
+	}
+
+	std::string out;
+	encodeTo(out, node, Flag_PRETTY_PRINT);
+	CHECK(out == encode(node, Flag_PRETTY_PRINT));
+	const char* data = out.data();
+	encodeTo(out, node);
+	CHECK(out == encode(node));
+	CHECK(out.data() == data);
+}
+
+TEST_CASE("Classify strings for quoting")
+{
+	auto classes = [](const std::string& s) { return classifyString(s.data(), s.size()); };
+	CHECK(classes("abc_123") == 0);
+	CHECK(classes("a-b") == Class_NOT_CLEAN);
+	CHECK(classes("a b") == (Class_NOT_CLEAN | Class_NOT_EXTENDED_CLEAN));
+	CHECK(classes("1/2") == Class_NOT_CLEAN);
+	CHECK(classes("a//b") == (Class_NOT_CLEAN | Class_COMMENT_START));
+	CHECK(classes("a/*b") == (Class_NOT_CLEAN | Class_COMMENT_START));
+	CHECK(classes("it's \"x\"") == (Class_NOT_CLEAN | Class_NOT_EXTENDED_CLEAN | Class_SINGLE_QUOTE | Class_DOUBLE_QUOTE));
+	CHECK(classes("a\\b") == (Class_NOT_CLEAN | Class_ESCAPE));
+	CHECK(classes("\x7f") == (Class_NOT_CLEAN | Class_NOT_EXTENDED_CLEAN | Class_ESCAPE));
+}
+
+// Writes a document through a Writer the way encode does
+template<typename F>
+static std::string writeDocument(uint32_t flags, F body)
+{
+	std::string result;
+	StringSink sink(result);
+	{
+		Writer w(sink, flags);
+		body(w);
+		if (flags & Flag_PRETTY_PRINT) { w.printNewline(); }
+	}
+	return result;
+}
+
+TEST_CASE("Write numbers without formatting them into strings")
+{
+	std::vector<float> floats = { 0.5f, -1.25f, 3.0f, 1e-7f };
+	std::vector<int64_t> ints = { INT64_MIN, -1, 0, INT64_MAX };
+
+	for (uint32_t flags : { 0u, (uint32_t)Flag_PRETTY_PRINT, (uint32_t)Flag_QUOTE_NUMERIC_VALUES }) {
+		Node expected = Node::Vector();
+		for (float f : floats) { expected.push_back(f); }
+		for (int64_t i : ints) { expected.push_back(i); }
+
+		std::string scalars = writeDocument(flags, [&](Writer& w) {
+			auto cw = w.vector();
+			for (float f : floats) { cw.next() = f; }
+			for (int64_t i : ints) { cw.next() = i; }
+		});
+		uint32_t quoteStrings = (flags & Flag_QUOTE_NUMERIC_VALUES) ? Flag_QUOTE_STRING_VALUES : 0;
+		CHECK(scalars == encode(expected, flags | quoteStrings | Flags_RELAXED_QUOTES));
+
+		std::string batched = writeDocument(flags, [&](Writer& w) { w.writeArray(floats.data(), floats.size()); });
+		CHECK(batched == encode(Node(floats), flags));
+	}
+
+	// Runs that straddle the end of a small buffer
+	std::vector<double> many(100, -2.2250738585072014e-308);
+	std::string out;
+	StringSink sink(out);
+	{
+		Writer w(sink, 0, 64);
+		w.writeArray(many.data(), many.size());
+	}
+	CHECK(out == encode(Node(many)));
+
+	std::string bools = writeDocument(Flag_QUOTE_BOOLEAN_VALUES | Flag_PREFER_SINGLE_QUOTES, [](Writer& w) {
+		auto cw = w.vector();
+		cw.next() = true;
+		cw.next() = false;
+	});
+	CHECK(bools == "['true','false']");
+}
+
+TEST_CASE("Write keys and values from string views")
+{
+	std::string_view line = "name=Lead Saw";
+	std::string out = writeDocument(0, [&](Writer& w) {
+		auto mw = w.map();
+		mw[line.substr(0, 4)] = line.substr(5);
+		mw["kind"] = "null";
+		mw["on"] = true;
+	});
+	CHECK(out == "{name:\"Lead Saw\",kind:null,on:true}");
+
+	Node node;
+	node["v"] = Node::Vector{ Node(), "x" };
+	CHECK(encode(node) == "{v:[null,x]}");
+}
+
+TEST_CASE("Indentation of deeply nested documents")
+{
+	Node node = "x";
+	for (int i = 0; i < 12; i++) {
+		node = Node(Node::Vector{ node });
+	}
+
+	for (uint32_t flags : { 0u, (uint32_t)Flag_CRLF_NEWLINES, (uint32_t)Flag_INDENT_WITH_SPACES, (uint32_t)(Flag_CRLF_NEWLINES | Flag_INDENT_WITH_SPACES) }) {
+		std::string newline = (flags & Flag_CRLF_NEWLINES) ? "\r\n" : "\n";
+		std::string indent = (flags & Flag_INDENT_WITH_SPACES) ? "    " : "\t";
+		auto line = [&](int depth) {
+			std::string result = newline;
+			for (int i = 0; i < depth; i++) { result += indent; }
+			return result;
+		};
+
+		std::string expected;
+		for (int i = 0; i < 12; i++) { expected += "[" + line(i + 1); }
+		expected += "x";
+		for (int i = 11; i >= 0; i--) { expected += line(i) + "]"; }
+		expected += newline;
+		CHECK(encode(node, flags | Flag_PRETTY_PRINT) == expected);
+	}
+}
+
+TEST_CASE("Parallel encoding matches sequential encoding")
+{
+	Node entries = Node::Vector();
+	for (int i = 0; i < 3000; i++) {
+		Node& entry = entries.push_back();
+		entry["id"] = i;
+		entry["name"] = "entry " + std::to_string(i);
+		entry["tags"] = Node::Vector{ "a", "b c" };
+	}
+
+	Node node;
+	node["entries"] = entries;
+	Node index;
+	for (int i = 0; i < 2000; i++) {
+		index["key" + std::to_string(i)] = i % 3 == 0 ? Node() : Node(i);
+	}
+	node["index"] = index;
+	// Only null entries at the start of a large map
+	Node sparse;
+	for (int i = 0; i < 1000; i++) {
+		sparse["k" + std::to_string(i)] = i < 600 ? Node() : Node("v");
+	}
+	node["sparse"] = sparse;
+	node["small"] = Node::Vector{ "1", "2" };
+
+	ThreadTaskPool pool(4);
+	for (uint32_t flags : { 0u, (uint32_t)Flag_PRETTY_PRINT, (uint32_t)(Flag_PRETTY_PRINT | Flag_INDENT_WITH_SPACES | Flags_JSON_STYLE_QUOTES) }) {
+		CHECK(encodeParallel(node, flags, &pool) == encode(node, flags));
+		CHECK(encodeParallel(entries, flags) == encode(entries, flags));
+	}
+	CHECK(encodeParallel(Node("x"), Flag_PRETTY_PRINT, &pool) == encode(Node("x"), Flag_PRETTY_PRINT));
+}
+
+static Node presetDocument(const char* cutoff)
+{
+	Node node;
+	node["name"] = "Lead";
+	node["filter"]["cutoff"] = cutoff;
+	node["filter"]["resonance"] = "0.2";
+	node["osc"] = Node::Vector{ "saw", "square" };
+	node["osc"][1] = Node::Vector{ "detune", "0.1" };
+	return node;
+}
+
+TEST_CASE("Encoding again after an edit")
+{
+	for (uint32_t flags : { 0u, (uint32_t)Flag_PRETTY_PRINT }) {
+		Node node = presetDocument("0.5");
+		CHECK(encode(node, flags) == encode(presetDocument("0.5"), flags));
+
+		node["filter"]["cutoff"] = "0.7";
+		CHECK(encode(node, flags) == encode(presetDocument("0.7"), flags));
+		CHECK(encode(node, flags | Flag_QUOTE_KEYS) == encode(presetDocument("0.7"), flags | Flag_QUOTE_KEYS));
+
+		Node copy = node.snapshot();
+		copy["osc"][(size_t)0] = "sine";
+		CHECK(encode(node, flags) == encode(presetDocument("0.7"), flags));
+
+#if KESON_ENABLE_ENCODE_CACHE
+		const Node& doc = node;
+		const Node& osc = doc["osc"];
+		CHECK(doc.cachedEncoding(flags, 0) != nullptr);
+		CHECK(osc.cachedEncoding(flags, 1) != nullptr);
+		CHECK(osc.cachedEncoding(flags, 0) == nullptr);
+
+		node["filter"]["resonance"] = "0.3";
+		CHECK(doc.cachedEncoding(flags, 0) == nullptr);
+		CHECK(doc["filter"].cachedEncoding(flags, 1) == nullptr);
+		CHECK(osc.cachedEncoding(flags, 1) != nullptr);
+#endif
+	}
+
+	// Output cut short by a small buffer is not kept
+	Node node = presetDocument("0.5");
+	char small[8];
+	encodeTo(small, sizeof(small), node);
+	CHECK(encode(node) == encode(presetDocument("0.5")));
+}
+
+TEST_CASE("Encoding sees writes through held references")
+{
+	Node root;
+	root["params"]["gain"] = 1;
+	root["params"]["pan"] = 0;
+	root["steps"] = Node::Vector{ "1", "2" };
+
+	Node& params = root["params"];
+	Node& step = root["steps"][1];
+	CHECK(encode(root) == "{params:{gain:1,pan:0},steps:[1,2]}");
+	params["gain"] = 2;
+	CHECK(encode(root) == "{params:{gain:2,pan:0},steps:[1,2]}");
+	step = 3;
+	CHECK(encode(root) == "{params:{gain:2,pan:0},steps:[1,3]}");
+
+	// After a snapshot the output is kept until the path to an edit is accessed again
+	Node saved = root.snapshot();
+	CHECK(encode(root) == "{params:{gain:2,pan:0},steps:[1,3]}");
+#if KESON_ENABLE_ENCODE_CACHE
+	const Node& doc = root;
+	CHECK(doc.cachedEncoding(0, 0) != nullptr);
+	CHECK(doc["params"].cachedEncoding(0, 1) != nullptr);
+#endif
+	root["params"]["gain"] = 4;
+	CHECK(encode(root) == "{params:{gain:4,pan:0},steps:[1,3]}");
+	CHECK(encode(saved) == "{params:{gain:2,pan:0},steps:[1,3]}");
+}
+
+TEST_CASE("Write raw fragments")
+{
+	Node inner;
+	inner["wave"] = "saw";
+	inner["steps"] = Node::Vector{ "1", "it's // \"quoted\"\nline" };
+
+	Node node;
+	node["name"] = "Lead";
+	node["osc"] = inner;
+	node["gain"] = "0.5";
+
+	for (uint32_t flags : { 0u, (uint32_t)Flag_PRETTY_PRINT, (uint32_t)(Flag_PRETTY_PRINT | Flag_CRLF_NEWLINES | Flag_INDENT_WITH_SPACES) }) {
+		std::string fragment = encode(inner, flags);
+		std::string out = writeDocument(flags, [&](Writer& w) {
+			auto mw = w.map();
+			mw["name"] = "Lead";
+			CHECK(mw["osc"].raw(fragment, Raw_VALIDATE | Raw_REINDENT));
+			mw["gain"] = "0.5";
+		});
+		CHECK(out == encode(node, flags));
+	}
+
+	CHECK(writeDocument(0, [](Writer& w) { w.raw("[1,2]"); }) == "[1,2]");
+	CHECK(writeDocument(Flag_PRETTY_PRINT, [](Writer& w) { w.vector().next().raw("['a\nb', // x'\n\t1\n]", Raw_REINDENT); })
+		== "[\n\t['a\nb', // x'\n\t\t1\n\t]\n]\n");
+	CHECK(writeDocument(0, [](Writer& w) { CHECK(!w.raw("[1,2", Raw_VALIDATE)); }) == "");
+	CHECK(writeDocument(0, [](Writer& w) { CHECK(!w.raw("1 // note", Raw_VALIDATE)); }) == "");
+
+	CHECK(isValidFragment("{a:[1,'x]'],b:\"\\\"\"}"));
+	CHECK(isValidFragment("  word // comment\n"));
+	CHECK(isValidFragment("{a:1 b=[2,,3], 'c' : {},}"));
+	CHECK(std::holds_alternative<Node>(decode("{a:1 b=[2,,3], 'c' : {},}")));
+	CHECK(isValidFragment("/* a /* nested */ comment */ [] "));
+	CHECK(!isValidFragment(""));
+	CHECK(!isValidFragment("[1,2"));
+	CHECK(!isValidFragment("[1,2}"));
+	CHECK(!isValidFragment("{a:'x}"));
+	CHECK(!isValidFragment("1 2"));
+	CHECK(!isValidFragment("a/b"));
+	CHECK(!isValidFragment("[] /* open"));
+	CHECK(!isValidFragment("]"));
+	CHECK(!isValidFragment("word // comment"));
+	CHECK(!isValidFragment("{a}"));
+	CHECK(!isValidFragment("{a b}"));
+	CHECK(!isValidFragment("{a:}"));
+	CHECK(!isValidFragment("{a::1}"));
+	CHECK(!isValidFragment("{:1}"));
+	CHECK(!isValidFragment("{[a]:1}"));
+	CHECK(!isValidFragment("[a:b]"));
+	CHECK(!isValidFragment("[a=b]"));
+
+	// A fragment ending in a line comment must not comment out what follows it
+	for (uint32_t flags : { 0u, (uint32_t)Flag_PRETTY_PRINT }) {
+		std::string out = writeDocument(flags, [](Writer& w) {
+			auto mw = w.map();
+			CHECK(mw["a"].raw("1 // note\n", Raw_VALIDATE | Raw_REINDENT));
+			mw["b"] = "2";
+		});
+		auto decoded = decode(out);
+		REQUIRE(std::holds_alternative<Node>(decoded));
+		CHECK(std::get<Node>(decoded)["b"].atom() == "2");
+	}
+}
@@ -1,31 +1,421 @@
-#include "node.h"
-#include "encode.h"
-#include "catch.h"
-
-#include <iostream>
-
-using namespace keson;
-
-TEST_CASE("Node")
-{
-	Node person;
-
-	person["name"] = "Bengan";
-	person["age"] = 23;
-	
-	Node hobbies;
-	hobbies.push_back("cars");
-	hobbies.push_back("babes");
-	person["hobbies"] = hobbies;
-
-	Node& friends = person["friends"];
-	Node& pal = friends.push_back();
-	pal["name"] = "The Sten-Ake";
-	pal["age"] = 56;
-
-	friends[1]["name"] = "Sara";
-	friends[1]["age"] = 2.75;
-
-	std::string encoded = encode(person, Flag_PREFER_SINGLE_QUOTES | Flag_QUOTE_KEYS | Flag_QUOTE_STRING_VALUES);
-	CHECK(encoded == "{'name':'Bengan','age':'23','hobbies':['cars','babes'],'friends':[{'name':'The Sten-Ake','age':'56'},{'name':'Sara','age':'2.75'}]}");
-}
+#include "node.h"
+#include "compact.h"
+#include "persistent.h"
+#include "merge.h"
+#include "encode.h"
+#include "memory.h"
+#include "catch.h"
+
+#include <iostream>
+
+using namespace keson;
+
+TEST_CASE("Node")
+{
+	Node person;
+
+	person["name"] = "Bengan";
+	person["age"] = 23;
+	
+	Node hobbies;
+	hobbies.push_back("cars");
+	hobbies.push_back("babes");
+	person["hobbies"] = hobbies;
+
+	Node& friends = person["friends"];
+	Node& pal = friends.push_back();
+	pal["name"] = "The Sten-Ake";
+	pal["age"] = 56;
+
+	friends[1]["name"] = "Sara";
+	friends[1]["age"] = 2.75;
+
+	std::string encoded = encode(person, Flag_PREFER_SINGLE_QUOTES | Flag_QUOTE_KEYS | Flag_QUOTE_STRING_VALUES);
+	CHECK(encoded == "{'name':'Bengan','age':'23','hobbies':['cars','babes'],'friends':[{'name':'The Sten-Ake','age':'56'},{'name':'Sara','age':'2.75'}]}");
+}
+
+TEST_CASE("Checked numeric access")
+{
+	Node n;
+	CHECK(!n.try_get<int32_t>());
+
+	n = "1234567890123";
+	CHECK(n.try_get<int64_t>() == 1234567890123);
+	CHECK(!n.try_get<int32_t>());
+
+	n = "-128";
+	CHECK(n.try_get<int8_t>() == -128);
+	CHECK(!n.try_get<uint8_t>());
+
+	n = "18446744073709551615";
+	CHECK(n.try_get<uint64_t>() == UINT64_MAX);
+	n = "18446744073709551616";
+	CHECK(!n.try_get<uint64_t>());
+
+	n = "0xff";
+	CHECK(n.try_get<uint8_t>() == 255);
+	CHECK((int)n == 255);
+	n = "-0b101";
+	CHECK(n.try_get<int32_t>() == -5);
+	n = "0o17";
+	CHECK(n.try_get<int32_t>() == 15);
+
+	n = "12abc";
+	CHECK(!n.try_get<int32_t>());
+	CHECK(!n.try_get<double>());
+	n = "2.5";
+	CHECK(n.try_get<double>() == 2.5);
+	n = "false";
+	CHECK(n.try_get<bool>() == false);
+	n = "no";
+	CHECK(!n.try_get<bool>());
+}
+
+TEST_CASE("Bulk numeric extraction")
+{
+	Node curve = Node::Vector{ "0", "0.25", "1e3", "-2" };
+	float values[4];
+	CHECK(curve.copy_to(values, 4) == 4);
+	CHECK(values[1] == 0.25f);
+	CHECK(values[2] == 1000.0f);
+
+	int32_t ints[4];
+	CHECK(curve.copy_to(ints, 4) == 1);
+	CHECK(curve.copy_to(values, 2) == 2);
+
+	curve[2] = Node::Vector{ "1" };
+	CHECK(curve.copy_to(values, 4) == 2);
+	CHECK(Node().copy_to(values, 4) == 0);
+}
+
+TEST_CASE("Packed arrays")
+{
+	Node table = std::vector<float>{ 0.0f, 0.5f, -1.0f };
+	CHECK(table.isPacked());
+	CHECK(!table.isVector());
+	CHECK(table.length() == 3);
+	CHECK(encode(table) == "[0,0.5,-1]");
+
+	Node atoms = Node::Vector{ "0", "0.5", "-1" };
+	CHECK(table == atoms);
+	CHECK(atoms == table);
+	CHECK(table.hash() == atoms.hash());
+	CHECK(table != Node(std::vector<float>{ 0.0f, 0.5f }));
+
+	double values[3];
+	CHECK(table.copy_to(values, 3) == 3);
+	CHECK(values[2] == -1.0);
+
+	// Read code written for vectors sees the elements as atoms
+	const Node& readOnly = table;
+	std::vector<std::string> seen;
+	for (auto& element : readOnly) {
+		seen.push_back(element.atom());
+	}
+	CHECK(seen == std::vector<std::string>{ "0", "0.5", "-1" });
+	CHECK(readOnly[(size_t)1].atom() == "0.5");
+	CHECK(readOnly.vector().size() == 3);
+	CHECK(table.isPacked());
+
+	Node copy = table.snapshot();
+	std::get<std::vector<float>>(copy.packed())[0] = 2.0f;
+	CHECK(static_cast<const Node&>(copy)[(size_t)0].atom() == "2");
+	CHECK(encode(table) == "[0,0.5,-1]");
+	CHECK(encode(copy) == "[2,0.5,-1]");
+
+	copy[3] = "x";
+	CHECK(copy.isVector());
+	CHECK(encode(copy, Flags_RELAXED_QUOTES) == "[2,0.5,-1,x]");
+}
+
+TEST_CASE("Memory usage")
+{
+	Node doc;
+	doc["name"] = std::string(100, 'x');
+	doc["table"] = std::vector<float>(1000);
+	doc["small"] = "y";
+
+	auto usage = memoryUsage(doc);
+	CHECK(usage.atoms >= 101);
+	CHECK(usage.packed >= 4000);
+	CHECK(usage.maps > 0);
+	CHECK(usage.vectors == 0);
+	REQUIRE(usage.byKey.size() == 3);
+	CHECK(usage.byKey[1].first == "table");
+	CHECK(usage.byKey[1].second >= 4000);
+	CHECK(usage.byKey[2].second == 0);
+
+	Node versions;
+	versions.push_back(doc.snapshot());
+	versions.push_back(doc.snapshot());
+	CHECK(memoryUsage(versions).total() - usage.total() < 200);
+
+	// Element Nodes made for reading a packed array are counted as cache
+	CHECK(usage.cache == 0);
+	const Node& table = static_cast<const Node&>(doc)["table"];
+	CHECK(table[(size_t)0].atom() == "0");
+	auto read = memoryUsage(doc);
+	CHECK(read.cache >= 1000 * sizeof(Node));
+	CHECK(read.total() - usage.total() == read.cache);
+	CHECK(read.withoutCache() == usage.total());
+
+#if KESON_ENABLE_ENCODE_CACHE
+	Node sealed = doc.snapshot();
+	std::string encoded = encode(doc);
+	CHECK(memoryUsage(doc).cache >= read.cache + encoded.size());
+#endif
+}
+
+TEST_CASE("CompactNode")
+{
+	Node preset;
+	preset["name"] = "A name that is too long to be stored inline";
+	preset["gain"] = 0.5f;
+	preset["curve"].push_back(1);
+	preset["curve"].push_back(-2);
+	preset["curve"].push_back(3);
+
+	CompactNode compact(preset);
+
+	CHECK((sizeof(void*) != 8 || sizeof(CompactNode) == 16));
+	CHECK(compact.isMap());
+	CHECK(compact.mapSize() == 3);
+	CHECK(compact["name"].atom() == "A name that is too long to be stored inline");
+	CHECK((float)compact["gain"] == 0.5f);
+	CHECK(compact["missing"].isNull());
+	CHECK(compact["curve"].length() == 3);
+	CHECK(compact["curve"][2].value_or(0) == 3);
+
+	CompactNode copy = compact;
+	CHECK(copy["curve"][1].atom() == "-2");
+
+	Node roundTrip = copy.toNode();
+	CHECK(roundTrip["name"].atom() == preset["name"].atom());
+	CHECK(encode(roundTrip["curve"], Flags_RELAXED_QUOTES) == "[1,-2,3]");
+}
+
+TEST_CASE("Map keeps insertion order")
+{
+	Node node;
+	for (int i = 0; i < 40; i++) {
+		node["key" + std::to_string(39 - i)] = i;
+	}
+
+	CHECK(node.map().size() == 40);
+	CHECK(node.map().begin()->first == "key39");
+	CHECK((int)node["key0"] == 39);
+	CHECK((int)node["key17"] == 22);
+
+	node.map().erase("key20");
+	CHECK(node.map().size() == 39);
+	CHECK(node.map().count("key20") == 0);
+	CHECK((int)node["key19"] == 20);
+	CHECK((node.map().begin() + 19)->first == "key19");
+}
+
+TEST_CASE("Lookup by string_view")
+{
+	Node node;
+	node["gain"] = 3;
+
+	std::string_view key = "gain_db";
+	key.remove_suffix(3);
+
+	const Node& c = node;
+	CHECK((int)c[key] == 3);
+	CHECK(c.find(key) == &node["gain"]);
+	CHECK(c.find("pan") == nullptr);
+	CHECK(Node(5).find("gain") == nullptr);
+
+	node[std::string_view("pan")] = -1;
+	CHECK((int)c["pan"] == -1);
+}
+
+TEST_CASE("Lookup by precomputed key")
+{
+	static constexpr Key VALUE("value");
+	static_assert(VALUE.hash() == hashKey("value"), "Key hash should be computed at compile time");
+
+	Node params;
+	for (int i = 0; i < 20; i++) {
+		params.push_back()[VALUE] = i;
+	}
+
+	const Node& c = params;
+	CHECK((int)c[19][VALUE] == 19);
+	CHECK(c[3].find(VALUE) == &params[3]["value"]);
+	CHECK(c[3].find(Key("missing")) == nullptr);
+}
+
+TEST_CASE("Snapshots share structure until written")
+{
+	Node preset;
+	preset["name"] = "Init";
+	preset["osc"]["shape"] = "saw";
+	preset["lfo"]["rate"] = 2;
+
+	Node undo = preset.snapshot();
+	const Node& a = preset;
+	const Node& b = undo;
+	CHECK(&a.map() == &b.map());
+
+	preset["osc"]["shape"] = "square";
+
+	CHECK(b["osc"]["shape"].atom() == "saw");
+	CHECK(a["osc"]["shape"].atom() == "square");
+	CHECK(&a["lfo"].map() == &b["lfo"].map());
+	CHECK(&a["osc"].map() != &b["osc"].map());
+
+	Node copy = preset;
+	CHECK(&copy.map() != &a.map());
+	CHECK(encode(copy) == encode(preset));
+}
+
+TEST_CASE("Moved from nodes are null")
+{
+	Node v = Node::Vector{ "1", "2" };
+	Node moved = std::move(v);
+	CHECK(v.isNull());
+	CHECK(v.length() == 0);
+	CHECK(encode(v) == "null");
+	v.push_back("3");
+	CHECK(v.length() == 1);
+	CHECK(moved.length() == 2);
+
+	Node m;
+	m["a"] = "1";
+	Node target;
+	target = std::move(m);
+	CHECK(m.isNull());
+	CHECK(m.find("a") == nullptr);
+	m["b"] = "2";
+	CHECK(m["b"].atom() == "2");
+	CHECK(target["a"].atom() == "1");
+
+	Node& self = target;
+	target = std::move(self);
+	CHECK(target["a"].atom() == "1");
+}
+
+TEST_CASE("PersistentNode versions share unchanged structure")
+{
+	Node preset;
+	preset["name"] = "Init";
+	preset["osc"]["shape"] = "saw";
+	for (int i = 0; i < 100; i++) {
+		preset["params"]["p" + std::to_string(i)] = i;
+		preset["table"].push_back(i);
+	}
+
+	PersistentNode v1(preset);
+	PersistentNode v2 = v1.set("osc", v1["osc"].set("shape", "square"));
+	PersistentNode v3 = v2.set("table", v2["table"].set(70, "seventy").push_back("end"));
+	PersistentNode v4 = v3.set("params", v3["params"].erase("p42"));
+
+	CHECK(v1["osc"]["shape"].atom() == "saw");
+	CHECK(v2["osc"]["shape"].atom() == "square");
+	CHECK(v2["params"].sharesWith(v1["params"]));
+	CHECK(v3["osc"].sharesWith(v2["osc"]));
+
+	CHECK(v2["table"].length() == 100);
+	CHECK(v3["table"].length() == 101);
+	CHECK(v2["table"][70].atom() == "70");
+	CHECK(v3["table"][70].atom() == "seventy");
+	CHECK(v3["table"][100].atom() == "end");
+
+	CHECK(v3["params"].mapSize() == 100);
+	CHECK(v4["params"].mapSize() == 99);
+	CHECK(v4["params"].find("p42") == nullptr);
+	CHECK(v4["params"]["p43"].atom() == "43");
+
+	CHECK(encode(v1.toNode()) == encode(preset));
+	CHECK(v4.set("name", "Renamed").entries()[0].first == "name");
+}
+
+TEST_CASE("Structural hash and equality")
+{
+	Node a;
+	a["name"] = "Init";
+	a["osc"]["shape"] = "saw";
+	a["table"].push_back(1);
+	a["table"].push_back(2);
+
+	Node b;
+	b["table"].push_back(1);
+	b["table"].push_back(2);
+	b["osc"]["shape"] = "saw";
+	b["name"] = "Init";
+	b["unset"];
+
+	CHECK(a.hash() == b.hash());
+	CHECK(a == b);
+
+	b["osc"]["shape"] = "square";
+	CHECK(a.hash() != b.hash());
+	CHECK(a != b);
+
+	b["osc"]["shape"] = "saw";
+	CHECK(a.hash() == b.hash());
+	CHECK(a == b);
+
+	b["table"][1] = 3;
+	CHECK(a != b);
+	CHECK(Node("1") != Node(Node::Vector{ "1" }));
+}
+
+TEST_CASE("Hashes follow writes through held references")
+{
+	Node a;
+	a["p"]["g"] = 1;
+	Node b;
+	b["p"]["g"] = 2;
+
+	Node& bp = b["p"];
+	a.hash();
+	b.hash();
+	bp["g"] = 1;
+	CHECK(a.hash() == b.hash());
+	CHECK(a == b);
+
+	// A snapshot seals both trees so that their hashes are kept, and the next
+	// mutable access exposes the path to it again
+	Node sa = a.snapshot();
+	Node sb = b.snapshot();
+	CHECK(sa == sb);
+	Node& g = b["p"]["g"];
+	CHECK(b == a);
+	g = 3;
+	CHECK(b != a);
+	CHECK(b.hash() != a.hash());
+	CHECK(sb == sa);
+}
+
+TEST_CASE("Merge layers")
+{
+	Node defaults;
+	defaults["gain"] = 0;
+	defaults["osc"]["shape"] = "saw";
+	defaults["osc"]["octave"] = 0;
+	defaults["tags"].push_back("factory");
+
+	Node user;
+	user["osc"]["shape"] = "square";
+	user["tags"].push_back("user");
+	user["extra"]["nested"] = 1;
+
+	Node host;
+	host["gain"];
+	host["osc"]["octave"];
+
+	Node merged = defaults;
+	merge(merged, std::move(user), Merge_CONCATENATE_VECTORS);
+	merge(merged, std::move(host), Merge_NULL_ERASES);
+
+	CHECK(encode(merged, Flags_RELAXED_QUOTES) == "{osc:{shape:square},tags:[factory,user],extra:{nested:1}}");
+
+	Node replaced = defaults;
+	Node overlay;
+	overlay["osc"]["shape"] = "sine";
+	merge(replaced, std::move(overlay), Merge_REPLACE_MAPS);
+	CHECK(encode(replaced, Flags_RELAXED_QUOTES) == "{osc:{shape:sine}}");
+}